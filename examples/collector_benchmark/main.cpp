@@ -0,0 +1,173 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <vector>
+#include <gflags/gflags.h>
+#include "common/common.h"
+#include "collector.h"
+#include "contention.h"
+#include "profiler.h"
+
+// 比较采样交给 grab_thread 的两种方式：Reducer（每次提交获取线程自己的 std::mutex，
+// grab_thread 逐个获取所有线程的 mutex）与每个线程的环形队列
+// 每个线程每毫秒提交一批采样，接近 profile 时采样的节奏，统计 Collected::submit 的平均耗时
+//
+// ./collector_benchmark [线程数] [每个线程的批次数] [每批的采样数]
+//
+// rate 模式检查采样率控制器：各线程在一个很热的地址和许多冷的地址上产生远超预算的事件，
+// 每秒输出实际的采样数，最后比较预热之后的平均值与 collector_expected_per_second，偏差超过 10% 时返回 1
+//
+// ./collector_benchmark rate [秒数] [线程数]
+
+namespace contention_prof {
+DECLARE_bool(collector_sample_ring);
+DECLARE_int32(collector_expected_per_second);
+}  // namespace contention_prof
+
+using contention_prof::SampledContention;
+using contention_prof::Util;
+
+static contention_prof::CollectorSpeedLimit g_rate_sl;
+static std::atomic<int64_t> g_rate_collected(0);
+static std::atomic<bool> g_rate_stop(false);
+
+// rate 模式的采样，只需要经过 grab_thread 更新 g_rate_sl
+class RateSample : public contention_prof::Collected {
+public:
+    void dump_and_destroy(size_t round) {
+        delete this;
+    }
+
+    void destroy() {
+        delete this;
+    }
+
+    contention_prof::CollectorSpeedLimit* speed_limit() {
+        return &g_rate_sl;
+    }
+};
+
+static void* rate_thread(void* arg) {
+    contention_prof::ignore_current_thread();
+    // 一半的事件在同一个地址上，其余的分散在 255 个地址上
+    static char sites[256 * 64];
+    uint64_t n = 0;
+    while (!g_rate_stop.load(std::memory_order_relaxed)) {
+        for (int i = 0; i < 256; ++i, ++n) {
+            const void* site = (n & 1) ? &sites[0] : &sites[(n % 255 + 1) * 64];
+            if (contention_prof::is_collectable(&g_rate_sl, site)) {
+                g_rate_collected.fetch_add(1, std::memory_order_relaxed);
+                (new RateSample)->submit(Util::get_monotonic_time_us());
+            }
+        }
+        usleep(100);
+    }
+    return nullptr;
+}
+
+static int run_rate(int seconds, int thread_count) {
+    const int WARMUP_SECONDS = 3;
+    const int expected = contention_prof::FLAGS_collector_expected_per_second;
+    contention_prof::set_collector_active(true);
+    std::vector<pthread_t> threads(thread_count);
+    for (auto& t : threads) {
+        pthread_create(&t, nullptr, rate_thread, nullptr);
+    }
+    int64_t total = 0;
+    for (int i = 0; i < seconds; ++i) {
+        const int64_t before = g_rate_collected.load(std::memory_order_relaxed);
+        sleep(1);
+        const int64_t collected = g_rate_collected.load(std::memory_order_relaxed) - before;
+        printf("second %3d: %6ld samples\n", i + 1, collected);
+        if (i >= WARMUP_SECONDS) {
+            total += collected;
+        }
+    }
+    g_rate_stop.store(true, std::memory_order_relaxed);
+    for (auto t : threads) {
+        pthread_join(t, nullptr);
+    }
+    contention_prof::set_collector_active(false);
+    if (seconds <= WARMUP_SECONDS) {
+        return 0;
+    }
+    const double average = static_cast<double>(total) / (seconds - WARMUP_SECONDS);
+    const double error = (average - expected) / expected;
+    printf("expected %d/s, achieved %.1f/s (%+.1f%%)\n", expected, average, error * 100);
+    return error > 0.1 || error < -0.1 ? 1 : 0;
+}
+
+struct BenchmarkArgs {
+    int batches;
+    int batch_size;
+    uint64_t submit_ns;
+};
+
+static void* submit_thread(void* arg) {
+    // 提交路径上的锁不需要采样
+    contention_prof::ignore_current_thread();
+    BenchmarkArgs* args = static_cast<BenchmarkArgs*>(arg);
+    std::vector<SampledContention*> samples(args->batch_size);
+    for (int i = 0; i < args->batches; ++i) {
+        for (auto& sc : samples) {
+            sc = contention_prof::get_object<SampledContention>();
+            sc->kind = contention_prof::SAMPLE_KIND_MUTEX;
+            sc->duration_ns = 1000;
+            sc->count = 1;
+            sc->stack_id = contention_prof::INVALID_STACK_ID;
+            sc->shallow_stack = false;
+        }
+        const uint64_t start_ns = Util::get_monotonic_time_ns();
+        for (auto sc : samples) {
+            sc->submit(start_ns / 1000);
+        }
+        args->submit_ns += Util::get_monotonic_time_ns() - start_ns;
+        usleep(1000);
+    }
+    return nullptr;
+}
+
+// 返回每次提交的平均耗时（纳秒）
+static double run(int thread_count, int batches, int batch_size) {
+    std::vector<pthread_t> threads(thread_count);
+    std::vector<BenchmarkArgs> args(thread_count, BenchmarkArgs{batches, batch_size, 0});
+    for (int i = 0; i < thread_count; ++i) {
+        pthread_create(&threads[i], nullptr, submit_thread, &args[i]);
+    }
+    uint64_t total_ns = 0;
+    for (int i = 0; i < thread_count; ++i) {
+        pthread_join(threads[i], nullptr);
+        total_ns += args[i].submit_ns;
+    }
+    return static_cast<double>(total_ns) / (static_cast<double>(thread_count) * batches * batch_size);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && strcmp(argv[1], "rate") == 0) {
+        return run_rate(argc > 2 ? atoi(argv[2]) : 13, argc > 3 ? atoi(argv[3]) : 4);
+    }
+    const int thread_count = argc > 1 ? atoi(argv[1]) : 64;
+    const int batches = argc > 2 ? atoi(argv[2]) : 1000;
+    const int batch_size = argc > 3 ? atoi(argv[3]) : 4;
+
+    std::vector<int> thread_counts;
+    for (int n = 1; n < thread_count; n *= 2) {
+        thread_counts.push_back(n);
+    }
+    thread_counts.push_back(thread_count);
+
+    printf("threads  reducer(ns/submit)  ring(ns/submit)  ring_overflows\n");
+    for (int n : thread_counts) {
+        contention_prof::FLAGS_collector_sample_ring = false;
+        const double reducer = run(n, batches, batch_size);
+        contention_prof::FLAGS_collector_sample_ring = true;
+        const double ring = run(n, batches, batch_size);
+        contention_prof::ContentionProfilerStats stats;
+        contention_prof::get_contention_profiler_stats(&stats);
+        printf("%7d  %18.1f  %15.1f  %14ld\n", n, reducer, ring, stats.sample_ring_overflows);
+    }
+    return 0;
+}
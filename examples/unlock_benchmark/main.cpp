@@ -0,0 +1,96 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "common/common.h"
+#include "profiler.h"
+
+// 测试 profile 期间没有竞争的加锁/解锁的开销随线程数的变化
+// 每个线程轮流使用自己的一组 mutex，不会有竞争。profile 打开时分别测试两种情况：
+// 没有其它竞争（idle），以及另外有若干线程在一个共享的 mutex 上持续竞争（busy），
+// 让 profiler 一直有采样、有被采样的等待者。两列的差别就是其它锁上的等待给无关的解锁带来的开销
+//
+// ./unlock_benchmark [最大线程数] [每个线程的加锁次数] [竞争的线程数]
+
+const int MUTEXES_PER_THREAD = 1024;
+
+static std::atomic<bool> g_stop(false);
+static pthread_mutex_t g_shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void* contend_thread(void*) {
+    while (!g_stop.load(std::memory_order_relaxed)) {
+        pthread_mutex_lock(&g_shared_mutex);
+        usleep(10);
+        pthread_mutex_unlock(&g_shared_mutex);
+    }
+    return nullptr;
+}
+
+static void* uncontended_thread(void* arg) {
+    const long loops = *static_cast<long*>(arg);
+    std::vector<pthread_mutex_t> mutexes(MUTEXES_PER_THREAD);
+    for (auto& m : mutexes) {
+        pthread_mutex_init(&m, nullptr);
+    }
+    for (long i = 0; i < loops; ++i) {
+        pthread_mutex_t* m = &mutexes[i & (MUTEXES_PER_THREAD - 1)];
+        pthread_mutex_lock(m);
+        pthread_mutex_unlock(m);
+    }
+    for (auto& m : mutexes) {
+        pthread_mutex_destroy(&m);
+    }
+    return nullptr;
+}
+
+static void start_contenders(std::vector<pthread_t>* contenders) {
+    g_stop.store(false);
+    for (auto& t : *contenders) {
+        pthread_create(&t, nullptr, contend_thread, nullptr);
+    }
+}
+
+static void stop_contenders(const std::vector<pthread_t>& contenders) {
+    g_stop.store(true);
+    for (auto t : contenders) {
+        pthread_join(t, nullptr);
+    }
+}
+
+// 返回每次加锁+解锁的平均耗时（纳秒）
+static double run(int thread_count, long loops) {
+    std::vector<pthread_t> threads(thread_count);
+    const uint64_t start_ns = contention_prof::Util::get_monotonic_time_ns();
+    for (auto& t : threads) {
+        pthread_create(&t, nullptr, uncontended_thread, &loops);
+    }
+    for (auto t : threads) {
+        pthread_join(t, nullptr);
+    }
+    const uint64_t elapsed_ns = contention_prof::Util::get_monotonic_time_ns() - start_ns;
+    // 线程并行执行，按照单个线程的耗时计算
+    return static_cast<double>(elapsed_ns) / loops;
+}
+
+int main(int argc, char* argv[]) {
+    const int max_threads = argc > 1 ? atoi(argv[1]) : static_cast<int>(std::thread::hardware_concurrency());
+    const long loops = argc > 2 ? atol(argv[2]) : 2000000L;
+    const int contender_count = argc > 3 ? atoi(argv[3]) : 2;
+
+    std::vector<pthread_t> contenders(contender_count);
+    printf("threads  off(ns/op)  on_idle(ns/op)  on_busy(ns/op)\n");
+    for (int n = 1; n <= max_threads; n *= 2) {
+        const double off = run(n, loops);
+        contention_prof::contention_profiler_start("./unlock_benchmark.prof");
+        const double on_idle = run(n, loops);
+        start_contenders(&contenders);
+        const double on_busy = run(n, loops);
+        stop_contenders(contenders);
+        contention_prof::contention_profiler_stop();
+        printf("%7d  %11.1f  %14.1f  %14.1f\n", n, off, on_idle, on_busy);
+    }
+    return 0;
+}
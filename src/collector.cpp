@@ -1,21 +1,43 @@
 #include <pthread.h>
+#include <poll.h>
 #include <string.h>
 #include <errno.h>
-#include <map>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <algorithm>
 #include <mutex>
 #include <list>
+#include <new>
+#include <vector>
 #include <gflags/gflags.h>
 #include "common/time.h"
 #include "common/log.h"
+#include "common/thread_local.h"
+#include "contention.h"
 #include "collector.h"
 
 namespace contention_prof {
 
 DEFINE_int32(collector_max_pending_samples, 1000, "Destroy unprocessed samples when they're too many");
 DEFINE_int32(collector_expected_per_second, 1000, "Expected number of samples to be collected per second");
+DEFINE_int32(collector_rate_decay_ms, 1000, "Time constant for averaging the estimated event rate of a "
+    "sampling stratum");
+DEFINE_bool(collector_sample_ring, true, "Hand samples to grab_thread through per-thread SPSC rings "
+    "instead of the Reducer");
+DEFINE_int32(collector_max_idle_interval_ms, 1000, "Longest sleep of grab_thread while a profile is active "
+    "but no samples arrive");
+DEFINE_int32(collector_wakeup_pending_samples, 500, "Wake grab_thread before its interval ends when one thread "
+    "has this many samples pending, 0 to disable");
 
+CollectorSpeedLimit g_cp_sl;
+CollectorSpeedLimit g_hold_sl;
 static CollectorSpeedLimit g_null_speed_limit;
 
+// 唤醒 grab_thread 的 eventfd，写入是异步信号安全的，可以在信号处理函数中唤醒
+static std::atomic<int> g_collector_wakeup_fd(-1);
+// 是否有正在进行的 profile，没有时 grab_thread 空闲后一直睡眠
+static std::atomic<bool> g_collector_active(false);
+
 struct CombineCollected {
     void operator()(Collected*& s1, Collected* s2) const {
         if (s2 == nullptr) {
@@ -29,6 +51,157 @@ struct CombineCollected {
     }
 };
 
+// 每个线程一个单生产者单消费者的环形队列，所属线程写入，grab_thread 读取，双方都不加锁
+// 所有队列串成一个只增不删的链表；线程退出时放弃自己的队列，之后创建的线程优先复用
+// 复用时队列中可能还有上一个线程留下的采样，仍然由 grab_thread 正常读取
+const uint32_t SAMPLE_RING_SIZE = 512;
+
+struct SampleRing {
+    // grab_thread 读取的位置，与 tail 分开在不同的缓存行
+    std::atomic<uint32_t> head;
+    char head_padding[64 - sizeof(std::atomic<uint32_t>)];
+    // 所属线程写入的位置
+    std::atomic<uint32_t> tail;
+    std::atomic<bool> in_use;
+    SampleRing* next;
+    Collected* slots[SAMPLE_RING_SIZE];
+};
+
+static std::atomic<SampleRing*> g_sample_rings(nullptr);
+// 队列已满而丢弃的采样数
+static std::atomic<int64_t> g_sample_ring_overflows(0);
+static __thread SampleRing* tls_sample_ring = nullptr;
+
+static void release_sample_ring() {
+    tls_sample_ring->in_use.store(false, std::memory_order_release);
+    tls_sample_ring = nullptr;
+}
+
+static SampleRing* get_sample_ring() {
+    if (tls_sample_ring != nullptr) {
+        return tls_sample_ring;
+    }
+    SampleRing* ring = nullptr;
+    for (SampleRing* r = g_sample_rings.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        bool expected = false;
+        if (!r->in_use.load(std::memory_order_relaxed)
+            && r->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            ring = r;
+            break;
+        }
+    }
+    if (ring == nullptr) {
+        ring = new (std::nothrow) SampleRing;
+        if (ring == nullptr) {
+            return nullptr;
+        }
+        ring->head.store(0, std::memory_order_relaxed);
+        ring->tail.store(0, std::memory_order_relaxed);
+        ring->in_use.store(true, std::memory_order_relaxed);
+        ring->next = g_sample_rings.load(std::memory_order_relaxed);
+        while (!g_sample_rings.compare_exchange_weak(ring->next, ring, std::memory_order_release)) {
+        }
+    }
+    thread_atexit(release_sample_ring);
+    tls_sample_ring = ring;
+    return ring;
+}
+
+// pending 输出写入后队列中待处理的采样数
+static bool push_to_sample_ring(Collected* p, uint32_t* pending) {
+    SampleRing* ring = get_sample_ring();
+    if (ring == nullptr) {
+        return false;
+    }
+    const uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+    const uint32_t used = tail - ring->head.load(std::memory_order_acquire);
+    if (used >= SAMPLE_RING_SIZE) {
+        g_sample_ring_overflows.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    ring->slots[tail % SAMPLE_RING_SIZE] = p;
+    ring->tail.store(tail + 1, std::memory_order_release);
+    *pending = used + 1;
+    return true;
+}
+
+// 不使用环形队列时，线程在 grab_thread 的一轮中提交的采样数
+struct TLSSubmittedSamples {
+    uint64_t grab_round;
+    uint32_t count;
+};
+
+static __thread TLSSubmittedSamples tls_submitted_samples = {0, 0};
+
+// 在 grab_thread 中取出所有队列中的采样
+template <typename Fn>
+static void drain_sample_rings(const Fn& fn) {
+    for (SampleRing* r = g_sample_rings.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        uint32_t head = r->head.load(std::memory_order_relaxed);
+        const uint32_t tail = r->tail.load(std::memory_order_acquire);
+        if (head == tail) {
+            continue;
+        }
+        for (; head != tail; ++head) {
+            fn(r->slots[head % SAMPLE_RING_SIZE]);
+        }
+        r->head.store(head, std::memory_order_release);
+    }
+}
+
+// grab_thread 中一个预处理器这一轮的采样
+struct PreprocessorBatch {
+    CollectorPreprocessor* preprocessor{nullptr};
+    std::vector<Collected*> samples;
+};
+
+// 预处理器和 speed_limit 都只有少数几个，使用定长数组线性查找
+const int COLLECTOR_MAX_PREPROCESSORS = 8;
+const int COLLECTOR_MAX_SPEED_LIMITS = 8;
+
+// 查找预处理器对应的一批，不存在时添加；超出 COLLECTOR_MAX_PREPROCESSORS 时归入第 0 项，不做预处理
+static PreprocessorBatch* get_preprocessor_batch(PreprocessorBatch* batches, int* count,
+    CollectorPreprocessor* preprocessor) {
+    if (preprocessor == nullptr) {
+        return &batches[0];
+    }
+    for (int i = 1; i < *count; ++i) {
+        if (batches[i].preprocessor == preprocessor) {
+            return &batches[i];
+        }
+    }
+    if (*count == COLLECTOR_MAX_PREPROCESSORS) {
+        static bool s_logged = false;
+        if (!s_logged) {
+            s_logged = true;
+            LOG(ERROR) << "Too many collector preprocessors, samples are grabbed without preprocessing";
+        }
+        return &batches[0];
+    }
+    batches[*count].preprocessor = preprocessor;
+    batches[*count].samples.reserve(FLAGS_collector_max_pending_samples);
+    return &batches[(*count)++];
+}
+
+// 记录出现过的 speed_limit，已经存在或者添加成功时返回 true；超出 COLLECTOR_MAX_SPEED_LIMITS 时返回 false，不再更新采样率
+static bool add_speed_limit(CollectorSpeedLimit** speed_limits, int* count, CollectorSpeedLimit* speed_limit) {
+    for (int i = 0; i < *count; ++i) {
+        if (speed_limits[i] == speed_limit) {
+            return true;
+        }
+    }
+    if (*count == COLLECTOR_MAX_SPEED_LIMITS) {
+        static bool s_logged = false;
+        if (!s_logged) {
+            s_logged = true;
+            LOG(ERROR) << "Too many collector speed limits, sampling ranges of the rest are not updated";
+        }
+        return false;
+    }
+    speed_limits[(*count)++] = speed_limit;
+    return true;
+}
+
 class Collector : public Reducer<Collected*, CombineCollected> {
 public:
     static Collector* get_instance() {
@@ -49,17 +222,53 @@ public:
         return last_active_cpuwide_us_;
     }
 
-    void wakeup_grab_thread();
+    // grab_thread 承诺的下一轮开始的时间，一直睡眠时为 INT64_MAX
+    int64_t grab_deadline_us() const {
+        return grab_deadline_us_.load(std::memory_order_relaxed);
+    }
+
+    // 这一轮开始之后，当前线程通过 Reducer 提交的采样数（包括这一次）
+    uint32_t count_reducer_sample() {
+        TLSSubmittedSamples& submitted = tls_submitted_samples;
+        const uint64_t round = grab_round_.load(std::memory_order_relaxed);
+        if (submitted.grab_round != round) {
+            submitted.grab_round = round;
+            submitted.count = 0;
+        }
+        return ++submitted.count;
+    }
+
+    // 有新的采样时调用，grab_thread 在空闲退避中，或者当前线程待处理的采样达到阈值时唤醒它
+    // 只按线程计数，采样路径不修改进程内共享的计数；阈值不超过队列容量的 3/4，队列写满之前唤醒
+    void on_sample_submitted(uint32_t pending) {
+        if (idle_.load(std::memory_order_relaxed) && idle_.exchange(false, std::memory_order_relaxed)) {
+            wakeup_collector();
+            return;
+        }
+        const uint32_t threshold = static_cast<uint32_t>(std::max(0, FLAGS_collector_wakeup_pending_samples));
+        if (threshold > 0 && pending == std::min(threshold, SAMPLE_RING_SIZE / 4 * 3)) {
+            wakeup_collector();
+        }
+    }
+
+    bool add_periodic_task(CollectorPeriodicTask task) {
+        for (auto& t : periodic_tasks_) {
+            CollectorPeriodicTask expected = nullptr;
+            if (t.compare_exchange_strong(expected, task, std::memory_order_acq_rel)) {
+                return true;
+            }
+        }
+        return false;
+    }
 
 private:
     void grab_thread();
     void dump_thread();
 
-    void update_speed_limit(
-        CollectorSpeedLimit* speed_limit,
-        size_t* last_grab_count,
-        size_t cur_grab_count,
-        int64_t interval_us);
+    // 睡眠到单调时钟的 abstime，abstime 为 -1 时一直睡眠，都可以被 wakeup_collector 提前唤醒
+    void sleep_until(int64_t abstime, int64_t now);
+
+    void update_speed_limit(CollectorSpeedLimit* speed_limit, int64_t interval_us);
 
     static void* run_grab_thread(void* arg) {
         static_cast<Collector*>(arg)->grab_thread();
@@ -72,6 +281,12 @@ private:
 
 private:
     int64_t last_active_cpuwide_us_{0};
+    std::atomic<int64_t> grab_deadline_us_{0};
+    // grab_thread 的睡眠超过了 COLLECTOR_GRAB_INTERVAL_US
+    std::atomic<bool> idle_{false};
+    // grab_thread 处理的轮数，不使用环形队列时各个线程据此重新开始计数
+    std::atomic<uint64_t> grab_round_{0};
+    std::atomic<CollectorPeriodicTask> periodic_tasks_[COLLECTOR_MAX_PERIODIC_TASKS] = {};
     bool created_{false};
     bool stop_{false};
     pthread_t grab_thread_{0};
@@ -82,16 +297,18 @@ private:
     pthread_mutex_t dump_thread_mutex_;
     pthread_cond_t dump_thread_cond_;
     LinkNode<Collected> dump_root_;
-    pthread_mutex_t sleep_mutex_;
-    pthread_cond_t sleep_cond_;
 };
 
 Collector::Collector() {
     last_active_cpuwide_us_ = Util::get_monotonic_time_us();
+    grab_deadline_us_.store(last_active_cpuwide_us_ + COLLECTOR_GRAB_INTERVAL_US, std::memory_order_relaxed);
     pthread_mutex_init(&dump_thread_mutex_, nullptr);
     pthread_cond_init(&dump_thread_cond_, nullptr);
-    pthread_mutex_init(&sleep_mutex_, nullptr);
-    pthread_cond_init(&sleep_cond_, nullptr);
+    const int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        LOG(ERROR) << "eventfd failed, grab_thread falls back to polling, err: " << strerror(errno);
+    }
+    g_collector_wakeup_fd.store(fd, std::memory_order_release);
     int res = pthread_create(&grab_thread_, nullptr, run_grab_thread, this);
     if (res != 0) {
         LOG(ERROR) << "Fail to create Collector, " << strerror(errno);
@@ -103,16 +320,21 @@ Collector::Collector() {
 Collector::~Collector() {
     if (created_) {
         stop_ = true;
+        wakeup_collector();
         pthread_join(grab_thread_, nullptr);
         created_ = false;
     }
     pthread_mutex_destroy(&dump_thread_mutex_);
     pthread_cond_destroy(&dump_thread_cond_);
-    pthread_mutex_destroy(&sleep_mutex_);
-    pthread_cond_destroy(&sleep_cond_);
+    const int fd = g_collector_wakeup_fd.exchange(-1, std::memory_order_acq_rel);
+    if (fd >= 0) {
+        close(fd);
+    }
 }
 
 void Collector::grab_thread() {
+    // 后台线程自己的锁操作和条件变量等待不需要采样
+    ignore_current_thread();
     last_active_cpuwide_us_ = Util::get_monotonic_time_us();
     int64_t last_before_update_sl = last_active_cpuwide_us_;
 
@@ -122,16 +344,25 @@ void Collector::grab_thread() {
         return;
     }
 
-    using GrabMap = std::map<CollectorSpeedLimit*, size_t>;
-    GrabMap last_grab_count_map;
-    GrabMap grab_count_map;
-    using PreprocessorMap = std::map<CollectorPreprocessor*, std::vector<Collected*>>;
-    PreprocessorMap prep_map;
+    // 按预处理器归类的采样，第 0 项为没有预处理器的采样，其余的在第一次出现时添加
+    // vector 只 clear 不释放，容量跨轮次保留，稳定后这里不会再分配内存
+    PreprocessorBatch batches[COLLECTOR_MAX_PREPROCESSORS];
+    int batches_count = 1;
+    batches[0].samples.reserve(FLAGS_collector_max_pending_samples);
+    CollectorSpeedLimit* speed_limits[COLLECTOR_MAX_SPEED_LIMITS];
+    int speed_limits_count = 0;
+    auto classify = [&batches, &batches_count](Collected* p) {
+        get_preprocessor_batch(batches, &batches_count, p->preprocessor())->samples.push_back(p);
+    };
 
+    // 这一轮之后的睡眠时间，-1 表示一直睡眠直到被唤醒
+    int64_t sleep_interval_us = COLLECTOR_GRAB_INTERVAL_US;
     for (; !stop_;) {
-        const int64_t abstime = last_active_cpuwide_us_ + COLLECTOR_GRAB_INTERVAL_US;
-        for (auto it = prep_map.begin(); it != prep_map.end(); ++it) {
-            it->second.clear();
+        const int64_t round_start_us = last_active_cpuwide_us_;
+        const int64_t round_grab_count = grab_count_;
+        grab_round_.fetch_add(1, std::memory_order_relaxed);
+        for (int i = 0; i < batches_count; ++i) {
+            batches[i].samples.clear();
         }
         // 获取到所有的 Agent（存储数据的链表）
         LinkNode<Collected>* head = this->reset();
@@ -141,74 +372,96 @@ void Collector::grab_thread() {
             head->insert_before_as_list(&tmp_root);
             head = nullptr;
 
-            // 将所有 Agent 中的数据归类到 prep_map 中
+            // 将所有 Agent 中的数据按照预处理器归类
             for (LinkNode<Collected>* p = tmp_root.next(); p != &tmp_root;) {
                 LinkNode<Collected>* saved_next = p->next();
                 // 先把 p 从链表中移除
                 p->remove_from_list();
-                // 按照预处理后的结果将其归类
-                CollectorPreprocessor* prep = p->value()->preprocessor();
-                prep_map[prep].push_back(p->value());
+                classify(p->value());
                 p = saved_next;
             }
-            LinkNode<Collected> root;
-            for (PreprocessorMap::iterator it = prep_map.begin(); it != prep_map.end(); ++it) {
-                std::vector<Collected*>& list = it->second;
-                if (it->second.empty()) {
-                    continue;
+        }
+        // 各个线程的环形队列中的数据同样归类
+        drain_sample_rings(classify);
+        LinkNode<Collected> root;
+        // 同一轮中的采样几乎总是属于同一个 speed_limit，记住上一次的
+        CollectorSpeedLimit* last_speed_limit = nullptr;
+        for (int i = 0; i < batches_count; ++i) {
+            std::vector<Collected*>& list = batches[i].samples;
+            if (list.empty()) {
+                continue;
+            }
+            // 将分类后的每一批进行处理
+            if (batches[i].preprocessor != nullptr) {
+                batches[i].preprocessor->process(list);
+            }
+            // 对每个数据进行处理
+            for (size_t j = 0; j < list.size(); ++j) {
+                Collected* p = list[j];
+                // 记录出现过的 speed_limit，之后每一轮都更新它们的采样率
+                CollectorSpeedLimit* speed_limit = p->speed_limit();
+                if (speed_limit == nullptr) {
+                    speed_limit = &g_null_speed_limit;
                 }
-                // 将分类后的每条链表进行处理
-                if (it->first != nullptr) {
-                    it->first->process(list);
+                if (speed_limit != last_speed_limit) {
+                    add_speed_limit(speed_limits, &speed_limits_count, speed_limit);
+                    last_speed_limit = speed_limit;
                 }
-                // 对链表中每个数据进行处理
-                for (size_t i = 0; i < list.size(); ++i) {
-                    Collected* p = list[i];
-                    // 对于不同 speed_limit 做分类
-                    CollectorSpeedLimit* speed_limit = p->speed_limit();
-                    if (speed_limit == nullptr) {
-                        ++grab_count_map[&g_null_speed_limit];
-                    } else {
-                        ++grab_count_map[speed_limit];
-                    }
-                    ++grab_count_;
-                    // 在做一次筛选
-                    if (grab_count_ >= drop_count_ + dump_count_ + FLAGS_collector_max_pending_samples) {
-                        ++drop_count_;
-                        p->destroy();
-                    } else {
-                        p->insert_before(&root);
-                    }
+                ++grab_count_;
+                // 在做一次筛选
+                if (grab_count_ >= drop_count_ + dump_count_ + FLAGS_collector_max_pending_samples) {
+                    ++drop_count_;
+                    p->destroy();
+                } else {
+                    p->insert_before(&root);
                 }
             }
-            // 将最终的链表赋给 dump_root_，并且唤醒 dump_thread 线程处理
-            if (root.next() != &root) {
-                LinkNode<Collected>* head2 = root.next();
-                root.remove_from_list();
-                pthread_mutex_lock(&dump_thread_mutex_);
-                head2->insert_before_as_list(&dump_root_);
-                pthread_cond_signal(&dump_thread_cond_);
-                pthread_mutex_unlock(&dump_thread_mutex_);
-            }
+        }
+        // 将最终的链表赋给 dump_root_，并且唤醒 dump_thread 线程处理
+        if (root.next() != &root) {
+            LinkNode<Collected>* head2 = root.next();
+            root.remove_from_list();
+            pthread_mutex_lock(&dump_thread_mutex_);
+            head2->insert_before_as_list(&dump_root_);
+            pthread_cond_signal(&dump_thread_cond_);
+            pthread_mutex_unlock(&dump_thread_mutex_);
         }
         int64_t now = Util::get_monotonic_time_us();
         // grab_thread 线程处理一次 “所有 agent 的数据” 花费的时间
         int64_t interval = now - last_before_update_sl;
         last_before_update_sl = now;
         // 更新每一种 speed_limit 的信息
-        for (GrabMap::iterator it = grab_count_map.begin(); it != grab_count_map.end(); ++it) {
-            update_speed_limit(it->first, &last_grab_count_map[it->first], it->second, interval);
+        for (int i = 0; i < speed_limits_count; ++i) {
+            update_speed_limit(speed_limits[i], interval);
+        }
+        for (auto& t : periodic_tasks_) {
+            CollectorPeriodicTask task = t.load(std::memory_order_acquire);
+            if (task != nullptr) {
+                task();
+            }
+        }
+        // 有采样时每 COLLECTOR_GRAB_INTERVAL_US（100ms）处理一轮，处理时间小于 100ms 时睡眠凑够 100ms
+        // 没有采样时逐轮加倍睡眠时间：profile 进行中最长 collector_max_idle_interval_ms，
+        // 没有 profile 时一直睡眠，直到有新的采样、profile 开始或者被信号处理函数唤醒
+        if (grab_count_ != round_grab_count) {
+            sleep_interval_us = COLLECTOR_GRAB_INTERVAL_US;
+        } else if (g_collector_active.load(std::memory_order_relaxed)) {
+            const int64_t max_idle_interval_us =
+                std::max<int64_t>(FLAGS_collector_max_idle_interval_ms * 1000L, COLLECTOR_GRAB_INTERVAL_US);
+            sleep_interval_us = std::min(std::max<int64_t>(sleep_interval_us, COLLECTOR_GRAB_INTERVAL_US) * 2,
+                max_idle_interval_us);
+        } else {
+            sleep_interval_us = -1;
         }
-        // 默认 COLLECTOR_GRAB_INTERVAL_US（100ms）的轮循处理时间，如果处理时间小于 100ms，那就睡眠凑够 100ms
         now = Util::get_monotonic_time_us();
         last_active_cpuwide_us_ = now;
-        if (!stop_ && abstime > now) {
-            timespec abstimespec = microseconds_from_now(abstime - now);
-            pthread_mutex_lock(&sleep_mutex_);
-            pthread_cond_timedwait(&sleep_cond_, &sleep_mutex_, &abstimespec);
-            pthread_mutex_unlock(&sleep_mutex_);
+        if (!stop_) {
+            sleep_until(sleep_interval_us < 0 ? -1 : round_start_us + sleep_interval_us, now);
         }
-        last_active_cpuwide_us_ = Util::get_monotonic_time_us();
+        now = Util::get_monotonic_time_us();
+        last_active_cpuwide_us_ = now;
+        grab_deadline_us_.store(now + COLLECTOR_GRAB_INTERVAL_US, std::memory_order_relaxed);
+        idle_.store(false, std::memory_order_relaxed);
     }
     pthread_mutex_lock(&dump_thread_mutex_);
     stop_ = true;
@@ -217,52 +470,110 @@ void Collector::grab_thread() {
     pthread_join(dump_thread_, nullptr);
 }
 
-void Collector::wakeup_grab_thread() {
-    pthread_mutex_lock(&sleep_mutex_);
-    pthread_cond_signal(&sleep_cond_);
-    pthread_mutex_unlock(&sleep_mutex_);
-}
-
-void Collector::update_speed_limit(
-    CollectorSpeedLimit* sl, size_t* last_grab_count,
-    size_t cur_grab_count, int64_t interval_us) {
-    const size_t round_grab_count = cur_grab_count - *last_grab_count;
-    if (round_grab_count == 0) {
+void Collector::sleep_until(int64_t abstime, int64_t now) {
+    if (abstime >= 0 && abstime <= now) {
         return;
     }
-    *last_grab_count = cur_grab_count;
-    if (interval_us < 0) {
-        interval_us = 0;
+    const int fd = g_collector_wakeup_fd.load(std::memory_order_acquire);
+    // 超过正常间隔的睡眠期间，新的采样会唤醒 grab_thread，也不会因为 grab_thread 长时间没有处理而被丢弃
+    const bool idle = abstime < 0 || abstime - now > COLLECTOR_GRAB_INTERVAL_US;
+    grab_deadline_us_.store(abstime < 0 ? INT64_MAX : abstime, std::memory_order_relaxed);
+    idle_.store(idle, std::memory_order_relaxed);
+    if (fd < 0) {
+        // 没有 eventfd 时退回到轮询，不会一直睡眠
+        usleep(abstime < 0 ? COLLECTOR_GRAB_INTERVAL_US : abstime - now);
+        return;
+    }
+    // 睡眠前已经有的唤醒不会丢失：eventfd 的计数在读取前一直可读
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (abstime < 0) {
+        poll(&pfd, 1, -1);
+    } else {
+        const timespec timeout = {static_cast<time_t>((abstime - now) / 1000000L),
+            static_cast<long>((abstime - now) % 1000000L * 1000L)};
+        ppoll(&pfd, 1, &timeout, nullptr);
+    }
+    uint64_t value = 0;
+    if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        LOG(ERROR) << "read eventfd failed, err: " << strerror(errno);
+    }
+}
+
+void Collector::update_speed_limit(CollectorSpeedLimit* sl, int64_t interval_us) {
+    int64_t sampled[SAMPLING_STRATA_COUNT];
+    int64_t total_sampled = 0;
+    for (int i = 0; i < SAMPLING_STRATA_COUNT; ++i) {
+        sampled[i] = sl->strata[i].sampled.exchange(0, std::memory_order_relaxed);
+        total_sampled += sampled[i];
     }
-    size_t new_sampling_range = 0;
-    const size_t old_sampling_range = sl->sampling_range;
     if (!sl->ever_grabbed) {
+        if (total_sampled == 0) {
+            return;
+        }
+        // 第一轮之前的采样从第一次采样开始计时
         if (sl->first_sample_real_us) {
-            interval_us = Util::gettimeofday_us() - sl->first_sample_real_us;
-            if (interval_us < 0) {
-                interval_us = 0;
-            }
+            interval_us = Util::get_monotonic_time_us() - sl->first_sample_real_us;
+        }
+    }
+    if (interval_us <= 0) {
+        interval_us = 1;
+    }
+    // 估计各层每秒的事件数：采样数和观察时间分别按时间常数衰减累计，取两者之比
+    // 取最大值的滤波器在每次随机的向上波动时都会抬高估计，估计偏高，采样数会系统性地低于预算；
+    // 这里上升和下降对称，只在采样数超过估计的两倍加 RATE_JUMP_SAMPLES（泊松波动几乎不可能达到）时立即采用
+    const int64_t decay_us = std::max<int64_t>(FLAGS_collector_rate_decay_ms * 1000L, 1);
+    const double keep = 1.0 - std::min(1.0, static_cast<double>(interval_us) / decay_us);
+    const double RATE_JUMP_SAMPLES = 8;
+    double rates[SAMPLING_STRATA_COUNT];
+    int active = 0;
+    for (int i = 0; i < SAMPLING_STRATA_COUNT; ++i) {
+        CollectorSpeedLimitStratum& stratum = sl->strata[i];
+        const size_t sampling_range = stratum.sampling_range.load(std::memory_order_relaxed);
+        const double exposure_s = interval_us / 1000000.0 * sampling_range / COLLECTOR_SAMPLING_BASE;
+        const double expected = stratum.event_rate.load(std::memory_order_relaxed) * exposure_s;
+        if (sampled[i] > 2 * expected + RATE_JUMP_SAMPLES) {
+            stratum.decayed_sampled = sampled[i];
+            stratum.decayed_exposure_s = exposure_s;
         } else {
-
+            stratum.decayed_sampled = stratum.decayed_sampled * keep + sampled[i];
+            stratum.decayed_exposure_s = stratum.decayed_exposure_s * keep + exposure_s;
         }
-        new_sampling_range = FLAGS_collector_expected_per_second
-            * interval_us * COLLECTOR_SAMPLING_BASE / (1000000L * round_grab_count);
-    } else {
-        new_sampling_range = FLAGS_collector_expected_per_second
-            * interval_us * old_sampling_range / (1000000L * round_grab_count);
-        if (interval_us < 1000000L) {
-            new_sampling_range = (new_sampling_range * interval_us
-                + old_sampling_range * (1000000L - interval_us)) / 1000000L;
+        const double rate =
+            stratum.decayed_exposure_s > 0 ? stratum.decayed_sampled / stratum.decayed_exposure_s : 0;
+        stratum.event_rate.store(rate, std::memory_order_relaxed);
+        rates[i] = rate;
+        if (rate > 0) {
+            ++active;
         }
     }
-    // 处理 new_sampling_range 边界值
-    if (new_sampling_range == 0) {
-        new_sampling_range = 1;
-    } else if (new_sampling_range > COLLECTOR_SAMPLING_BASE) {
-        new_sampling_range = COLLECTOR_SAMPLING_BASE;
+    // 最大最小公平地分配预算：事件数不超过平均份额的层全部采样，剩余的预算在其它层之间平分，直到不再变化
+    double budget = FLAGS_collector_expected_per_second;
+    bool satisfied[SAMPLING_STRATA_COUNT] = {};
+    double share = budget;
+    for (bool changed = true; changed && active > 0;) {
+        changed = false;
+        share = budget / active;
+        for (int i = 0; i < SAMPLING_STRATA_COUNT; ++i) {
+            if (!satisfied[i] && rates[i] > 0 && rates[i] <= share) {
+                satisfied[i] = true;
+                budget -= rates[i];
+                --active;
+                changed = true;
+            }
+        }
     }
-    if (new_sampling_range != old_sampling_range) {
-        sl->sampling_range = new_sampling_range;
+    for (int i = 0; i < SAMPLING_STRATA_COUNT; ++i) {
+        // 没有事件的层全部采样，新出现的锁在下一轮之前不会被漏掉
+        size_t new_sampling_range = COLLECTOR_SAMPLING_BASE;
+        if (rates[i] > 0 && !satisfied[i]) {
+            new_sampling_range = static_cast<size_t>(COLLECTOR_SAMPLING_BASE * share / rates[i]);
+            if (new_sampling_range == 0) {
+                new_sampling_range = 1;
+            } else if (new_sampling_range > COLLECTOR_SAMPLING_BASE) {
+                new_sampling_range = COLLECTOR_SAMPLING_BASE;
+            }
+        }
+        sl->strata[i].sampling_range.store(new_sampling_range, std::memory_order_relaxed);
     }
     // 打开 ever_grabbed 为 true，当判断是否收集时，采用随机数方式
     if (!sl->ever_grabbed) {
@@ -271,6 +582,7 @@ void Collector::update_speed_limit(
 }
 
 void Collector::dump_thread() {
+    ignore_current_thread();
     // int64_t last_ns = Util::get_monotonic_time_ns();
     // double busy_seconds = 0;
 
@@ -308,7 +620,13 @@ void Collector::dump_thread() {
     }
 }
 
-size_t is_collectable_before_first_time_grabbed(CollectorSpeedLimit* sl) {
+// 按地址的哈希分层，低位因为对齐通常是 0，先去掉
+inline int get_sampling_stratum(const void* site) {
+    const uint64_t hash = (reinterpret_cast<uintptr_t>(site) >> 4) * 0x9E3779B97F4A7C15ULL;
+    return static_cast<int>(hash >> 32) & (SAMPLING_STRATA_COUNT - 1);
+}
+
+size_t is_collectable_before_first_time_grabbed(CollectorSpeedLimit* sl, CollectorSpeedLimitStratum* stratum) {
     if (!sl->ever_grabbed) {
         int before_add = sl->count_before_grabbed.fetch_add(1, std::memory_order_relaxed);
         if (before_add == 0) {
@@ -316,33 +634,78 @@ size_t is_collectable_before_first_time_grabbed(CollectorSpeedLimit* sl) {
         } else if (before_add >= FLAGS_collector_expected_per_second) {
             // 如果 grab_thread 线程在执行前，积攒的数量已经超过了 FLAGS_collector_expected_per_second
             // 那就触发 grab_thread 线程去处理
-            Collector::get_instance()->wakeup_grab_thread();
+            wakeup_collector();
         }
     }
-    return sl->sampling_range;
+    stratum->sampled.fetch_add(1, std::memory_order_relaxed);
+    return stratum->sampling_range.load(std::memory_order_relaxed);
 }
 
-inline size_t is_collectable(CollectorSpeedLimit* speed_limit) {
+size_t is_collectable(CollectorSpeedLimit* speed_limit, const void* site) {
+    CollectorSpeedLimitStratum* stratum = &speed_limit->strata[get_sampling_stratum(site)];
     if (__glibc_likely(speed_limit->ever_grabbed)) {
-        const size_t sampling_range = speed_limit->sampling_range;
+        const size_t sampling_range = stratum->sampling_range.load(std::memory_order_relaxed);
         if ((fast_rand() & (COLLECTOR_SAMPLING_BASE - 1)) >= sampling_range) {
             return 0;
         }
+        stratum->sampled.fetch_add(1, std::memory_order_relaxed);
         return sampling_range;
     }
-    return is_collectable_before_first_time_grabbed(speed_limit);
+    return is_collectable_before_first_time_grabbed(speed_limit, stratum);
+}
+
+bool add_collector_periodic_task(CollectorPeriodicTask task) {
+    return Collector::get_instance()->add_periodic_task(task);
 }
 
 void Collected::submit(uint64_t cpu_time_us) {
     Collector* d = Collector::get_instance();
-    // last_active_cpuwide_us() 会被 grab_thread 线程周期性的更新
-    // 对于周期外的数据，就地销毁。因为我们期望 grab_thread 线程可以 200ms 完成一次刷新
-    // 超过 200ms 也就同时说明数据过多，处理太慢了，就地销毁没有符合逻辑
-    if (cpu_time_us < d->last_active_cpuwide_us() + COLLECTOR_GRAB_INTERVAL_US * 2) {
+    // grab_deadline_us() 是 grab_thread 下一轮开始的时间，空闲退避时相应推后
+    // 超过它一个 COLLECTOR_GRAB_INTERVAL_US 还没有处理，说明数据过多，处理太慢了，就地销毁
+    if (cpu_time_us >= static_cast<uint64_t>(d->grab_deadline_us()) + COLLECTOR_GRAB_INTERVAL_US) {
+        destroy();
+        return;
+    }
+    uint32_t pending = 0;
+    if (!FLAGS_collector_sample_ring) {
         *d << this;
-    } else {
+        pending = d->count_reducer_sample();
+    } else if (!push_to_sample_ring(this, &pending)) {
         destroy();
+        return;
+    }
+    d->on_sample_submitted(pending);
+}
+
+void wakeup_collector() {
+    const int fd = g_collector_wakeup_fd.load(std::memory_order_acquire);
+    if (fd < 0) {
+        return;
     }
+    // 可能在信号处理函数中执行，不能改变 errno
+    const int saved_errno = errno;
+    const uint64_t value = 1;
+    // 计数溢出（EAGAIN）时已经有足够多的唤醒，忽略错误
+    ssize_t res = write(fd, &value, sizeof(value));
+    (void)res;
+    errno = saved_errno;
+}
+
+void set_collector_active(bool active) {
+    g_collector_active.store(active, std::memory_order_relaxed);
+    if (active) {
+        // 让一直睡眠的 grab_thread 回到正常的间隔，并开始执行周期任务
+        Collector::get_instance();
+        wakeup_collector();
+    }
+}
+
+int64_t get_collector_last_active_us() {
+    return Collector::get_instance()->last_active_cpuwide_us();
+}
+
+int64_t get_collector_sample_ring_overflows() {
+    return g_sample_ring_overflows.load(std::memory_order_relaxed);
 }
 
 }  // namespace contention_prof
@@ -20,8 +20,9 @@
 #include "common/common.h"
 #include "common/linked_list.h"
 #include "common/reducer.h"
-#include "common/murmurhash3.h"
 #include "profiler.h"
+#include "sample_kind.h"
+#include "stack_table.h"
 #include "common/object_pool.h"
 
 namespace contention_prof {
@@ -29,15 +30,45 @@ namespace contention_prof {
 const size_t COLLECTOR_SAMPLING_BASE = 16384;
 const int64_t COLLECTOR_GRAB_INTERVAL_US = 100000L;  // 100ms
 
+// 采样率控制器中的一层，独占一个缓存行
+struct alignas(64) CollectorSpeedLimitStratum {
+    // 事件被采样的概率为 sampling_range / COLLECTOR_SAMPLING_BASE
+    std::atomic<size_t> sampling_range;
+    // grab_thread 上一轮之后被采样的事件数
+    std::atomic<int64_t> sampled;
+    // 估计的每秒事件数，由 grab_thread 更新
+    std::atomic<double> event_rate;
+    // 按 collector_rate_decay_ms 衰减累计的被采样的事件数，以及按采样率折算成全部采样的观察秒数
+    // 两者之比就是 event_rate，只由 grab_thread 使用
+    double decayed_sampled;
+    double decayed_exposure_s;
+
+    CollectorSpeedLimitStratum()
+        : sampling_range(COLLECTOR_SAMPLING_BASE)
+        , sampled(0)
+        , event_rate(0)
+        , decayed_sampled(0)
+        , decayed_exposure_s(0) {}
+};
+
+/**
+ * 采样率控制器，把每秒采样的数量控制在 collector_expected_per_second 附近
+ * 事件按锁地址的哈希分为 SAMPLING_STRATA_COUNT 层，每一层有自己的采样率：
+ * grab_thread 每一轮根据各层被采样的数量和采样率估计每秒的事件数，再把预算按最大最小公平的方式分给各层，
+ * 一个很热的锁只会用完自己那一层的预算，其它锁上少见但很长的等待仍然会被采到
+ * 事件数的估计是按 collector_rate_decay_ms 衰减的采样数与观察时间之比，上升和下降对称，长期看没有偏差，
+ * 每秒的采样数平均起来等于预算（事件总数不足时除外）；只有一轮采到的数量远超估计、不可能是随机波动时
+ * 才立即采用这一轮的测量值，热点出现时立即收紧
+ * 估计值只依赖于采到的数量和当时的采样率，不依赖于上一轮的调整，不会来回振荡
+ */
 struct CollectorSpeedLimit {
-    size_t sampling_range;
     bool ever_grabbed;
     std::atomic<int> count_before_grabbed;
     int64_t first_sample_real_us;
+    CollectorSpeedLimitStratum strata[SAMPLING_STRATA_COUNT];
 
     CollectorSpeedLimit()
-        : sampling_range(COLLECTOR_SAMPLING_BASE)
-        , ever_grabbed(false)
+        : ever_grabbed(false)
         , count_before_grabbed(0)
         , first_sample_real_us(0) {}
 };
@@ -61,17 +92,28 @@ public:
     virtual CollectorPreprocessor* preprocessor() { return nullptr; }
 };
 
-static CollectorSpeedLimit g_cp_sl;
+extern CollectorSpeedLimit g_cp_sl;
+// 持有时间（SAMPLE_KIND_HOLD）的采样率，每次加锁都会参与采样，与等待分开控制
+extern CollectorSpeedLimit g_hold_sl;
 
 /**
  * @brief 实际被存储的数据
  * 
  */
 struct SampledContention : public Collected {
+    // 采样类型，参考 SampleKind
+    int kind;
     int64_t duration_ns;
     double count;
-    int frames_count;
-    void* stack[26];
+    // 这次采样中每次事件的等待时间（未按采样率还原），用于直方图
+    int64_t event_duration_ns;
+    // 采样的时间（gettimeofday）和线程，作为最长等待的样例
+    int64_t time_us;
+    pid_t tid;
+    // 调用栈在 stack_table 中的 ID
+    uint32_t stack_id;
+    // 是否为 adaptive_stack_depth 下被截断的浅调用栈
+    bool shallow_stack;
 
     /**
      * @brief 数据的拷贝和清理
@@ -96,20 +138,52 @@ struct SampledContention : public Collected {
     }
 
     CollectorSpeedLimit* speed_limit() {
-        return &g_cp_sl;
+        return kind == SAMPLE_KIND_HOLD ? &g_hold_sl : &g_cp_sl;
     }
 
     size_t hash_code() const {
-        if (frames_count == 0) {
+        if (stack_id == INVALID_STACK_ID) {
             return 0;
         }
-        uint32_t code = 1;
-        uint32_t seed = frames_count;
-        MurmurHash3_x86_32(stack, sizeof(void*) * frames_count, seed, &code);
-        return code;
+        return static_cast<size_t>(stack_id) * SAMPLE_KIND_COUNT + kind;
     }
 };
 
-inline size_t is_collectable(CollectorSpeedLimit* speed_limit);
+/**
+ * @brief 决定这次事件是否采样
+ *
+ * @param speed_limit 采样率控制器
+ * @param site 事件所在的锁（或者条件变量、信号量等）的地址，用于分层，可以为 nullptr
+ * @return size_t 采样时返回采样范围，用于还原实际的时间和次数；不采样时返回 0
+ */
+size_t is_collectable(CollectorSpeedLimit* speed_limit, const void* site);
+
+/**
+ * @brief 唤醒 grab_thread 立即处理一轮，异步信号安全，可以在信号处理函数中调用
+ */
+void wakeup_collector();
+
+/**
+ * @brief 设置是否有正在进行的 profile
+ * 进行中时 grab_thread 最长每 collector_max_idle_interval_ms 处理一轮，周期任务按这个间隔执行；
+ * 没有 profile 并且没有采样时，grab_thread 一直睡眠到被唤醒
+ *
+ * @param active
+ */
+void set_collector_active(bool active);
+
+// grab_thread 最近一次处理的时间（单调时钟），每一轮都会更新
+int64_t get_collector_last_active_us();
+
+// collector_sample_ring 开启时，线程的环形队列已满而丢弃的采样数，进程内累计
+int64_t get_collector_sample_ring_overflows();
+
+// grab_thread 每一轮都会调用的任务，轮次之间的间隔参考 set_collector_active
+// 用于把信号处理函数、采样路径中不能做的事情（比如文件操作、获取加载器的锁）放到后台线程中执行，
+// 需要尽快执行时调用 wakeup_collector
+// 最多 COLLECTOR_MAX_PERIODIC_TASKS 个，添加后不能移除，超出时返回 false
+typedef void (*CollectorPeriodicTask)();
+const int COLLECTOR_MAX_PERIODIC_TASKS = 4;
+bool add_collector_periodic_task(CollectorPeriodicTask task);
 
 }  // namespace contention_prof
@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
 #include <fstream>
 #include <sstream>
 #include "common.h"
@@ -27,6 +28,29 @@ int64_t Util::gettimeofday_us() {
     return now.tv_sec * 1000000L + now.tv_usec;
 }
 
+pid_t Util::get_tid() {
+    static __thread pid_t tid = 0;
+    if (tid == 0) {
+        tid = static_cast<pid_t>(syscall(SYS_gettid));
+    }
+    return tid;
+}
+
+double Util::get_cpu_cycles_per_second() {
+    static const double cycles_per_second = []() {
+        const uint64_t start_ns = get_monotonic_time_ns();
+        const uint64_t start_cycles = get_cpu_cycles();
+        usleep(10000);
+        const uint64_t end_ns = get_monotonic_time_ns();
+        const uint64_t end_cycles = get_cpu_cycles();
+        if (end_ns <= start_ns) {
+            return 1E9;
+        }
+        return (end_cycles - start_cycles) * 1E9 / (end_ns - start_ns);
+    }();
+    return cycles_per_second;
+}
+
 uint64_t Util::fmix64(uint64_t k) {
     k ^= k >> 33;
     k *= 0xff51afd7ed558ccdULL;
@@ -12,7 +12,11 @@
 #pragma once
 
 #include <stdint.h>
+#include <sys/types.h>
 #include <string>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 namespace contention_prof {
 
@@ -21,6 +25,19 @@ public:
     static uint64_t get_monotonic_time_ns();
     static uint64_t get_monotonic_time_us();
     static int64_t gettimeofday_us();
+    // 当前线程的 tid，每个线程只做一次系统调用
+    static pid_t get_tid();
+
+    // 读取 CPU 周期计数（x86 上为 TSC），其它平台退化为纳秒
+    static inline uint64_t get_cpu_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return get_monotonic_time_ns();
+#endif
+    }
+    // get_cpu_cycles 每秒增长的数量，第一次调用时用单调时钟校准，耗时约 10ms
+    static double get_cpu_cycles_per_second();
 
     static uint64_t fmix64(uint64_t m);
 
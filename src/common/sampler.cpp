@@ -1,4 +1,7 @@
+#include <errno.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include "common/reducer.h"
 #include "common/log.h"
 #include "common/common.h"
@@ -31,7 +34,11 @@ public:
     SamplerCollector()
         : created_(false)
         , stop_(false)
-        , cumulated_time_us_(0) {
+        , cumulated_time_us_(0)
+        , wakeup_fd_(eventfd(0, EFD_CLOEXEC)) {
+        if (wakeup_fd_ < 0) {
+            LOG(ERROR) << "eventfd failed, sampling_thread falls back to polling, err: " << strerror(errno);
+        }
         int res = pthread_create(&tid_, nullptr, sampling_thread, this);
         if (res != 0) {
             LOG(ERROR) << "create sampling_thread failed";
@@ -42,9 +49,23 @@ public:
     ~SamplerCollector() {
         if (created_) {
             stop_ = true;
+            wakeup();
             pthread_join(tid_, nullptr);
             created_ = false;
         }
+        if (wakeup_fd_ >= 0) {
+            close(wakeup_fd_);
+        }
+    }
+
+    // 有新的 Sampler 时唤醒一直睡眠的 sampling_thread
+    void wakeup() {
+        if (wakeup_fd_ < 0) {
+            return;
+        }
+        const uint64_t value = 1;
+        ssize_t res = write(wakeup_fd_, &value, sizeof(value));
+        (void)res;
     }
 
     static double get_cumulated_time(void* arg) {
@@ -53,6 +74,9 @@ public:
 
 private:
     void run();
+    // 等待 wakeup，之前已经有的唤醒不会丢失：eventfd 的计数在读取前一直可读
+    // 不使用条件变量：本库拦截了 pthread_cond_wait，空闲的等待会被当作条件变量的竞争采样
+    void wait_for_wakeup();
     static void* sampling_thread(void* arg) {
         ((SamplerCollector*)arg)->run();
         return nullptr;
@@ -63,8 +87,21 @@ private:
     bool stop_;
     int64_t cumulated_time_us_;
     pthread_t tid_;
+    int wakeup_fd_;
 };
 
+void SamplerCollector::wait_for_wakeup() {
+    if (wakeup_fd_ < 0) {
+        usleep(1000000L);
+        return;
+    }
+    uint64_t value = 0;
+    if (read(wakeup_fd_, &value, sizeof(value)) < 0 && errno != EINTR) {
+        LOG(ERROR) << "read eventfd failed, err: " << strerror(errno);
+        usleep(1000000L);
+    }
+}
+
 void SamplerCollector::run() {
     LinkNode<Sampler> root;
     int consecutive_nosleep = 0;
@@ -95,6 +132,11 @@ void SamplerCollector::run() {
         bool slept = false;
         int64_t now = Util::gettimeofday_us();
         cumulated_time_us_ += now - abstime;
+        // 没有 Sampler 时一直睡眠，直到 schedule 添加了新的 Sampler
+        if (root.next() == &root) {
+            wait_for_wakeup();
+            continue;
+        }
         abstime += 1000000L;
         for (; abstime > now;) {
             usleep(abstime - now);
@@ -113,7 +155,9 @@ void SamplerCollector::run() {
 }
 
 void Sampler::schedule() {
-    *SamplerCollector::get_instance() << this;
+    SamplerCollector* collector = SamplerCollector::get_instance();
+    *collector << this;
+    collector->wakeup();
 }
 
 }  // namespace contention_prof
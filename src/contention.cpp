@@ -1,57 +1,212 @@
 #include <dlfcn.h>
 #include <errno.h>
-#include <execinfo.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <threads.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <algorithm>
 #include <atomic>
 #include <mutex>
 #include <memory>
+#include <gflags/gflags.h>
 #include "common/common.h"
 #include "collector.h"
 #include "common/object_pool.h"
 #include "common/log.h"
+#include "common/thread_local.h"
+#include "histogram.h"
 #include "profiler.h"
+#include "sample_kind.h"
+#include "stack_memo.h"
+#include "stack_table.h"
+#include "stack_trace.h"
 #include "contention.h"
 
 namespace contention_prof {
 
+DEFINE_bool(hold_time_profile, false, "Sample critical-section length of all locks, contended or not");
+DEFINE_bool(adaptive_stack_depth, false, "Capture only adaptive_stack_shallow_depth frames until the "
+    "shallow stack becomes hot (see adaptive_stack_hot_wait_us), then capture full stacks");
+DEFINE_int32(adaptive_stack_shallow_depth, 4, "Frames captured for stacks that are not hot yet");
+DEFINE_bool(duration_sampling, false, "Time every contended lock acquisition and decide whether to keep it "
+    "from the measured wait instead of sampling before the wait");
+DEFINE_int32(duration_sampling_threshold_us, 1000, "With duration_sampling, waits at least this long are always "
+    "kept and shorter ones are kept with probability proportional to their length");
+DEFINE_bool(sample_pre_aggregation, true, "Fold repeated samples with the same stack, kind and histogram "
+    "bucket in a per-thread buffer before handing them to the collector");
+
 // 锁操作的函数类型
 typedef int (*pthread_mutex_lock_func_type)(pthread_mutex_t *mutex);
 typedef int (*pthread_mutex_unlock_func_type)(pthread_mutex_t *mutex);
+typedef int (*pthread_mutex_timedlock_func_type)(pthread_mutex_t *mutex, const struct timespec *abstime);
+typedef int (*pthread_mutex_clocklock_func_type)(pthread_mutex_t *mutex, clockid_t clockid,
+    const struct timespec *abstime);
+typedef int (*mtx_func_type)(mtx_t *mtx);
+typedef int (*mtx_timedlock_func_type)(mtx_t *mtx, const struct timespec *time_point);
+typedef int (*pthread_rwlock_func_type)(pthread_rwlock_t *rwlock);
+typedef int (*pthread_spin_func_type)(pthread_spinlock_t *lock);
+typedef int (*sem_wait_func_type)(sem_t *sem);
+typedef int (*sem_timedwait_func_type)(sem_t *sem, const struct timespec *abstime);
+typedef int (*pthread_barrier_init_func_type)(pthread_barrier_t *barrier,
+    const pthread_barrierattr_t *attr, unsigned int count);
+typedef int (*pthread_barrier_func_type)(pthread_barrier_t *barrier);
+typedef int (*pthread_cond_wait_func_type)(pthread_cond_t *cond, pthread_mutex_t *mutex);
+typedef int (*pthread_cond_timedwait_func_type)(pthread_cond_t *cond, pthread_mutex_t *mutex,
+    const struct timespec *abstime);
+typedef int (*pthread_cond_signal_func_type)(pthread_cond_t *cond);
 
 // 定义锁操作的系统接口
 static pthread_mutex_lock_func_type real_pthread_mutex_lock_func = nullptr;
 static pthread_mutex_unlock_func_type real_pthread_mutex_unlock_func = nullptr;
+static pthread_mutex_timedlock_func_type real_pthread_mutex_timedlock_func = nullptr;
+static pthread_mutex_clocklock_func_type real_pthread_mutex_clocklock_func = nullptr;
+static mtx_func_type real_mtx_lock_func = nullptr;
+static mtx_func_type real_mtx_trylock_func = nullptr;
+static mtx_timedlock_func_type real_mtx_timedlock_func = nullptr;
+static mtx_func_type real_mtx_unlock_func = nullptr;
+static pthread_rwlock_func_type real_pthread_rwlock_rdlock_func = nullptr;
+static pthread_rwlock_func_type real_pthread_rwlock_wrlock_func = nullptr;
+static pthread_rwlock_func_type real_pthread_rwlock_tryrdlock_func = nullptr;
+static pthread_rwlock_func_type real_pthread_rwlock_trywrlock_func = nullptr;
+static pthread_rwlock_func_type real_pthread_rwlock_unlock_func = nullptr;
+static pthread_spin_func_type real_pthread_spin_lock_func = nullptr;
+static pthread_spin_func_type real_pthread_spin_unlock_func = nullptr;
+static sem_wait_func_type real_sem_wait_func = nullptr;
+static sem_timedwait_func_type real_sem_timedwait_func = nullptr;
+static pthread_barrier_init_func_type real_pthread_barrier_init_func = nullptr;
+static pthread_barrier_func_type real_pthread_barrier_destroy_func = nullptr;
+static pthread_barrier_func_type real_pthread_barrier_wait_func = nullptr;
+static pthread_cond_wait_func_type real_pthread_cond_wait_func = nullptr;
+static pthread_cond_timedwait_func_type real_pthread_cond_timedwait_func = nullptr;
+static pthread_cond_signal_func_type real_pthread_cond_signal_func = nullptr;
+static pthread_cond_signal_func_type real_pthread_cond_broadcast_func = nullptr;
+
+// glibc 中条件变量的接口有新旧两个版本，dlsym 可能拿到旧版本，这里明确指定新版本
+static void* dlsym_cond_func(const char* name) {
+    void* func = dlvsym(RTLD_NEXT, name, "GLIBC_2.3.2");
+    if (func == nullptr) {
+        func = dlsym(RTLD_NEXT, name);
+    }
+    return func;
+}
 
 // 初始化函数
 void mutex_hook_init() {
     real_pthread_mutex_lock_func = (pthread_mutex_lock_func_type)dlsym(RTLD_NEXT, "pthread_mutex_lock");
     real_pthread_mutex_unlock_func = (pthread_mutex_unlock_func_type)dlsym(RTLD_NEXT, "pthread_mutex_unlock");
+    real_pthread_mutex_timedlock_func =
+        (pthread_mutex_timedlock_func_type)dlsym(RTLD_NEXT, "pthread_mutex_timedlock");
+    real_pthread_mutex_clocklock_func =
+        (pthread_mutex_clocklock_func_type)dlsym(RTLD_NEXT, "pthread_mutex_clocklock");
+    real_mtx_lock_func = (mtx_func_type)dlsym(RTLD_NEXT, "mtx_lock");
+    real_mtx_trylock_func = (mtx_func_type)dlsym(RTLD_NEXT, "mtx_trylock");
+    real_mtx_timedlock_func = (mtx_timedlock_func_type)dlsym(RTLD_NEXT, "mtx_timedlock");
+    real_mtx_unlock_func = (mtx_func_type)dlsym(RTLD_NEXT, "mtx_unlock");
+    real_pthread_rwlock_rdlock_func = (pthread_rwlock_func_type)dlsym(RTLD_NEXT, "pthread_rwlock_rdlock");
+    real_pthread_rwlock_wrlock_func = (pthread_rwlock_func_type)dlsym(RTLD_NEXT, "pthread_rwlock_wrlock");
+    real_pthread_rwlock_tryrdlock_func = (pthread_rwlock_func_type)dlsym(RTLD_NEXT, "pthread_rwlock_tryrdlock");
+    real_pthread_rwlock_trywrlock_func = (pthread_rwlock_func_type)dlsym(RTLD_NEXT, "pthread_rwlock_trywrlock");
+    real_pthread_rwlock_unlock_func = (pthread_rwlock_func_type)dlsym(RTLD_NEXT, "pthread_rwlock_unlock");
+    real_pthread_spin_lock_func = (pthread_spin_func_type)dlsym(RTLD_NEXT, "pthread_spin_lock");
+    real_pthread_spin_unlock_func = (pthread_spin_func_type)dlsym(RTLD_NEXT, "pthread_spin_unlock");
+    real_sem_wait_func = (sem_wait_func_type)dlsym(RTLD_NEXT, "sem_wait");
+    real_sem_timedwait_func = (sem_timedwait_func_type)dlsym(RTLD_NEXT, "sem_timedwait");
+    real_pthread_barrier_init_func = (pthread_barrier_init_func_type)dlsym(RTLD_NEXT, "pthread_barrier_init");
+    real_pthread_barrier_destroy_func = (pthread_barrier_func_type)dlsym(RTLD_NEXT, "pthread_barrier_destroy");
+    real_pthread_barrier_wait_func = (pthread_barrier_func_type)dlsym(RTLD_NEXT, "pthread_barrier_wait");
+    real_pthread_cond_wait_func = (pthread_cond_wait_func_type)dlsym_cond_func("pthread_cond_wait");
+    real_pthread_cond_timedwait_func = (pthread_cond_timedwait_func_type)dlsym_cond_func("pthread_cond_timedwait");
+    real_pthread_cond_signal_func = (pthread_cond_signal_func_type)dlsym_cond_func("pthread_cond_signal");
+    real_pthread_cond_broadcast_func = (pthread_cond_signal_func_type)dlsym_cond_func("pthread_cond_broadcast");
 }
 
-const int TLS_MAX_COUNT = 3;
-
+// lock 可以是 pthread_mutex_t 或者 pthread_rwlock_t，只用作 key
 struct MutexAndContentionSite {
-    pthread_mutex_t* mutex;
+    void* lock;
     pthread_contention_site_t csite;
+    // 持有时间的采样，duration_ns 为之前各段持有时间的累计（pthread_cond_wait 会把持有时间分段）
+    pthread_contention_site_t hold_csite;
+    // 当前这一段持有的开始时间
+    uint64_t hold_start_ns;
+};
+
+// TLS 中直接存放 TLS_INLINE_COUNT 个登记项，嵌套更深时从 g_free_tls_chunks 借用 chunk，
+// 每个线程最多 TLS_MAX_CHUNKS 个，线程退出时归还。超出后才使用 g_mutex_map
+const int TLS_INLINE_COUNT = 4;
+const int TLS_CHUNK_SIZE = 16;
+const int TLS_MAX_CHUNKS = 4;
+
+struct TLSContentionSiteChunk {
+    // 空闲链表中的下一个
+    TLSContentionSiteChunk* next;
+    MutexAndContentionSite list[TLS_CHUNK_SIZE];
 };
 
 struct TLSPthreadContentionSites {
     int count;
+    // 当前线程持有的锁的数量，只统计 profile 期间经过 hook 的加锁和解锁，
+    // trylock 没有 hook，它的解锁可能使这个值偏小，因此不会减到 0 以下
+    int lock_depth;
+    // 当前线程登记在 g_mutex_map 中、还没有解锁的锁的数量，为 0 时解锁不需要查 g_mutex_map
+    // 加锁和解锁在同一个线程，这就是一个精确的过滤条件，不需要访问所有线程共享的表
+    int global_count;
     uint64_t cp_version;
-    MutexAndContentionSite list[TLS_MAX_COUNT];
+    MutexAndContentionSite list[TLS_INLINE_COUNT];
+    TLSContentionSiteChunk* chunks[TLS_MAX_CHUNKS];
+
+    MutexAndContentionSite& at(int i) {
+        if (i < TLS_INLINE_COUNT) {
+            return list[i];
+        }
+        i -= TLS_INLINE_COUNT;
+        return chunks[i / TLS_CHUNK_SIZE]->list[i % TLS_CHUNK_SIZE];
+    }
 };
 
-static __thread TLSPthreadContentionSites tls_csites = {0, 0, {}};
+static __thread TLSPthreadContentionSites tls_csites = {0, 0, 0, 0, {}, {}};
 static __thread bool tls_inside_lock = false;
 
-const size_t MUTEX_MAP_SIZE = 1024;
+// 一次被采样的条件变量等待，拆分为等待信号和被唤醒后重新获取 mutex 两段
+// pthread_cond_wait 返回时仍持有 mutex，所以在 mutex 解锁后再提交
+struct TLSCondWaitSite {
+    pthread_mutex_t* mutex;
+    uint64_t cp_version;
+    pthread_contention_site_t signal_csite;
+    pthread_contention_site_t reacquire_csite;
+};
+
+static __thread TLSCondWaitSite tls_cond_site = {nullptr, 0, {0, 0, 0}, {0, 0, 0}};
+
 struct MutexMapEntry {
     std::atomic<uint64_t> versioned_mutex;
     pthread_contention_site_t csite;
 };
-// 存储 mutex 和 csite 的对应关系，数组最长 MUTEX_MAP_SIZE 长度
-// 只监控 MUTEX_MAP_SIZE 个锁
-static MutexMapEntry g_mutex_map[MUTEX_MAP_SIZE] = {};
+
+// 存储 mutex 和 csite 的对应关系，TLS 已满时使用
+// 由多个开放寻址的表组成，第 i 个表的容量为 MUTEX_MAP_INIT_SIZE * 4^i，第一个表是静态的
+// 一个锁在每个表中最多探测 MUTEX_MAP_MAX_PROBES 个位置，都被占用时使用下一个表
+// 加锁路径中不分配：最后一个表的占用超过一半，或者加锁时因为下一个表不存在而丢弃了采样，
+// 由 grab_thread 分配下一个表。表一旦分配不再释放，也不搬迁表项，profile 结束时清空
+const size_t MUTEX_MAP_INIT_SIZE = 1024;
+const int MUTEX_MAP_MAX_TABLES = 6;
+const size_t MUTEX_MAP_MAX_PROBES = 8;
+
+struct MutexMapTable {
+    std::atomic<MutexMapEntry*> entries;
+    // 被占用的表项数，包括之前 profile 遗留的表项，为 0 时解锁不需要查这个表
+    std::atomic<int64_t> size;
+};
+
+static MutexMapEntry g_mutex_map_first_entries[MUTEX_MAP_INIT_SIZE] = {};
+static MutexMapTable g_mutex_map[MUTEX_MAP_MAX_TABLES] = {{{g_mutex_map_first_entries}, {0}}};
+// 探测时遇到被其它锁占用的表项的次数
+static std::atomic<int64_t> g_mutex_map_collisions(0);
+// 所有表都没有空位而丢弃的采样数
+static std::atomic<int64_t> g_mutex_map_drops(0);
+// 加锁时需要的下一个表还没有分配，请求 grab_thread 分配
+static std::atomic<bool> g_mutex_map_grow_requested(false);
 
 bool is_contention_site_valid(const pthread_contention_site_t& cs) {
     return cs.sampling_range;
@@ -61,139 +216,1693 @@ void make_contention_site_invalid(pthread_contention_site_t* cs) {
     cs->sampling_range = 0;
 }
 
-inline uint64_t hash_mutex_ptr(const pthread_mutex_t* m) {
+inline uint64_t hash_mutex_ptr(const void* m) {
     return Util::fmix64((uint64_t)m);
 }
 
 const int PTR_BITS = 48;
 
-pthread_contention_site_t* add_pthread_contention_site(pthread_mutex_t* mutex) {
-    MutexMapEntry& entry = g_mutex_map[hash_mutex_ptr(mutex) & (MUTEX_MAP_SIZE - 1)];
-    auto& m = entry.versioned_mutex;
-    uint64_t expected = m.load(std::memory_order_relaxed);
-    if (expected == 0 || (expected >> PTR_BITS) != (g_cp_version & ((1 << (64 - PTR_BITS)) - 1))) {
-        uint64_t desired = (g_cp_version << PTR_BITS) | (uint64_t)mutex;
-        if (m.compare_exchange_strong(expected, desired, std::memory_order_acquire)) {
-            return &entry.csite;
+inline size_t get_mutex_map_capacity(int level) {
+    return MUTEX_MAP_INIT_SIZE << (2 * level);
+}
+
+// 分配第 level 个表，只由 grab_thread 调用
+static void grow_mutex_map(int level) {
+    const size_t bytes = get_mutex_map_capacity(level) * sizeof(MutexMapEntry);
+    void* mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        LOG(ERROR) << "mmap mutex map failed, level: " << level << ", err: " << strerror(errno);
+        return;
+    }
+    g_mutex_map[level].entries.store(static_cast<MutexMapEntry*>(mem), std::memory_order_release);
+}
+
+void grow_mutex_map_if_needed() {
+    int level = 0;
+    while (level + 1 < MUTEX_MAP_MAX_TABLES && g_mutex_map[level + 1].entries.load(std::memory_order_acquire)) {
+        ++level;
+    }
+    if (level + 1 >= MUTEX_MAP_MAX_TABLES) {
+        return;
+    }
+    const bool requested = g_mutex_map_grow_requested.exchange(false, std::memory_order_relaxed);
+    const int64_t size = g_mutex_map[level].size.load(std::memory_order_relaxed);
+    if (requested || size * 2 >= static_cast<int64_t>(get_mutex_map_capacity(level))) {
+        grow_mutex_map(level + 1);
+    }
+}
+
+void clear_pthread_contention_sites() {
+    for (int level = 0; level < MUTEX_MAP_MAX_TABLES; ++level) {
+        MutexMapTable& table = g_mutex_map[level];
+        MutexMapEntry* entries = table.entries.load(std::memory_order_acquire);
+        if (entries == nullptr) {
+            break;
+        }
+        if (table.size.load(std::memory_order_relaxed) == 0) {
+            continue;
+        }
+        const size_t capacity = get_mutex_map_capacity(level);
+        for (size_t i = 0; i < capacity; ++i) {
+            // 与仍在进行的 remove 竞争，只有清除成功的一方减少 size
+            uint64_t expected = entries[i].versioned_mutex.load(std::memory_order_relaxed);
+            if (expected != 0 && entries[i].versioned_mutex.compare_exchange_strong(expected, 0,
+                std::memory_order_relaxed)) {
+                table.size.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+pthread_contention_site_t* add_pthread_contention_site(void* mutex) {
+    const uint64_t version = g_cp_version & ((1 << (64 - PTR_BITS)) - 1);
+    const uint64_t desired = (version << PTR_BITS) | (uint64_t)mutex;
+    const uint64_t hash = hash_mutex_ptr(mutex);
+    for (int level = 0; level < MUTEX_MAP_MAX_TABLES; ++level) {
+        MutexMapEntry* entries = g_mutex_map[level].entries.load(std::memory_order_acquire);
+        if (entries == nullptr) {
+            // 加锁路径中不调用 mmap，这次采样丢弃
+            if (!g_mutex_map_grow_requested.load(std::memory_order_relaxed)) {
+                g_mutex_map_grow_requested.store(true, std::memory_order_relaxed);
+            }
+            break;
+        }
+        const size_t mask = get_mutex_map_capacity(level) - 1;
+        for (size_t i = 0; i < MUTEX_MAP_MAX_PROBES; ++i) {
+            MutexMapEntry& entry = entries[(hash + i) & mask];
+            uint64_t expected = entry.versioned_mutex.load(std::memory_order_relaxed);
+            // 空闲或者之前 profile 遗留的表项可以占用
+            if ((expected == 0 || (expected >> PTR_BITS) != version)
+                && entry.versioned_mutex.compare_exchange_strong(expected, desired, std::memory_order_acquire)) {
+                if (expected == 0) {
+                    g_mutex_map[level].size.fetch_add(1, std::memory_order_relaxed);
+                }
+                return &entry.csite;
+            }
+            g_mutex_map_collisions.fetch_add(1, std::memory_order_relaxed);
         }
     }
+    g_mutex_map_drops.fetch_add(1, std::memory_order_relaxed);
     return nullptr;
 }
 
-bool remove_pthread_contention_site(pthread_mutex_t* mutex, pthread_contention_site_t* saved_csite) {
-    MutexMapEntry& entry = g_mutex_map[hash_mutex_ptr(mutex) & (MUTEX_MAP_SIZE - 1)];
-    auto& m = entry.versioned_mutex;
-    if ( (m.load(std::memory_order_relaxed) & ( ( ((uint64_t)1) << PTR_BITS) - 1))
-        != (uint64_t)mutex) {
-        return false;
+// 只匹配本次 profile 占用的表项，之前 profile 遗留的表项留给之后的 add 覆盖
+bool remove_pthread_contention_site(void* mutex, pthread_contention_site_t* saved_csite) {
+    const uint64_t version = g_cp_version & ((1 << (64 - PTR_BITS)) - 1);
+    const uint64_t desired = (version << PTR_BITS) | (uint64_t)mutex;
+    const uint64_t hash = hash_mutex_ptr(mutex);
+    for (int level = 0; level < MUTEX_MAP_MAX_TABLES; ++level) {
+        MutexMapTable& table = g_mutex_map[level];
+        MutexMapEntry* entries = table.entries.load(std::memory_order_acquire);
+        if (entries == nullptr) {
+            break;
+        }
+        if (table.size.load(std::memory_order_relaxed) == 0) {
+            continue;
+        }
+        const size_t mask = get_mutex_map_capacity(level) - 1;
+        for (size_t i = 0; i < MUTEX_MAP_MAX_PROBES; ++i) {
+            MutexMapEntry& entry = entries[(hash + i) & mask];
+            if (entry.versioned_mutex.load(std::memory_order_relaxed) != desired) {
+                continue;
+            }
+            *saved_csite = entry.csite;
+            make_contention_site_invalid(&entry.csite);
+            // 可能同时被 clear_pthread_contention_sites 清除
+            uint64_t expected = desired;
+            if (!entry.versioned_mutex.compare_exchange_strong(expected, 0, std::memory_order_release,
+                std::memory_order_relaxed)) {
+                return false;
+            }
+            table.size.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
     }
-    *saved_csite = entry.csite;
-    make_contention_site_invalid(&entry.csite);
-    m.store(0, std::memory_order_release);
-    return true;
+    return false;
 }
 
-// 注意这个函数在锁外执行
-void submit_contention(const pthread_contention_site_t& csite, int64_t now_ns) {
-    // 使用 TLS 进行加锁，收集锁竞争的代码中可能会调用 pthread_mutex_lock
-    tls_inside_lock = true;
-    // 从对象池中获取一个对象
+
+// 调用栈的交接槽，由一个线程写入，其它线程读取
+// 保存 (seq << 32) | stack_id，调用栈本身在 stack_table 中，seq 每次写入加一
+struct StackSlot {
+    std::atomic<uint64_t> value;
+
+    void store(uint32_t stack_id) {
+        uint64_t old = value.load(std::memory_order_relaxed);
+        while (!value.compare_exchange_weak(old, (((old >> 32) + 1) << 32) | stack_id,
+            std::memory_order_release, std::memory_order_relaxed)) {
+        }
+    }
+
+    // 当前已经保存的调用栈的 seq
+    uint32_t get_seq() const {
+        return static_cast<uint32_t>(value.load(std::memory_order_acquire) >> 32);
+    }
+
+    // 返回调用栈的 ID，没有保存过时返回 INVALID_STACK_ID
+    uint32_t load() const {
+        return static_cast<uint32_t>(value.load(std::memory_order_acquire));
+    }
+
+    // 只读取 last_seq（get_seq 的返回值）之后保存的调用栈，否则返回 INVALID_STACK_ID
+    // seq 输出当前的 seq，不等于 last_seq 但返回 INVALID_STACK_ID 时，说明这个 seq 已预留但还没有 publish
+    uint32_t load(uint32_t last_seq, uint32_t* seq) const {
+        const uint64_t v = value.load(std::memory_order_acquire);
+        *seq = static_cast<uint32_t>(v >> 32);
+        return *seq == last_seq ? INVALID_STACK_ID : static_cast<uint32_t>(v);
+    }
+
+    // 预留下一个 seq，调用栈稍后再用 publish 保存，在这之前 load 读到 INVALID_STACK_ID
+    uint32_t reserve() {
+        uint64_t old = value.load(std::memory_order_relaxed);
+        while (!value.compare_exchange_weak(old, ((old >> 32) + 1) << 32,
+            std::memory_order_release, std::memory_order_relaxed)) {
+        }
+        return static_cast<uint32_t>(old >> 32) + 1;
+    }
+
+    // 以 reserve 预留的 seq 保存调用栈，之后 seq 已经被再次预留或保存时放弃
+    void publish(uint32_t seq, uint32_t stack_id) {
+        uint64_t expected = static_cast<uint64_t>(seq) << 32 | INVALID_STACK_ID;
+        value.compare_exchange_strong(expected, expected | stack_id,
+            std::memory_order_release, std::memory_order_relaxed);
+    }
+
+    // 由调用者指定高 32 位的 tag，代替自增的 seq，与 load_tagged 配合使用
+    void store_tagged(uint32_t stack_id, uint32_t tag) {
+        value.store((static_cast<uint64_t>(tag) << 32) | stack_id, std::memory_order_release);
+    }
+
+    // 只读取以 tag 保存的调用栈，否则返回 INVALID_STACK_ID
+    uint32_t load_tagged(uint32_t tag) const {
+        const uint64_t v = value.load(std::memory_order_acquire);
+        return static_cast<uint32_t>(v >> 32) == tag ? static_cast<uint32_t>(v) : INVALID_STACK_ID;
+    }
+};
+
+const size_t COND_MAP_SIZE = 1024;
+struct CondMapEntry {
+    std::atomic<uint64_t> versioned_cond;
+    // 最近一次被 signal/broadcast 的时间，用于拆分等待时间
+    std::atomic<uint64_t> signal_time_ns;
+    // 正在等待的线程数
+    std::atomic<int> waiters;
+    // 正在等待的线程中被采样的数量，不为 0 时每次 signal/broadcast 都要保存调用栈
+    std::atomic<int> sampled_waiters;
+    // 每次 signal/broadcast 加一，等待者被唤醒时记下它，用来找到唤醒自己的那一次
+    std::atomic<uint32_t> wakeup_generation;
+    // 最近一次保存了调用栈的 signal/broadcast 的调用栈，tag 为它的 wakeup_generation，无效唤醒归因到这里
+    StackSlot wakeup_stack;
+};
+// 条件变量的统计信息，每次 profile 中一个表项被第一个映射到它的 cond 占用
+static CondMapEntry g_cond_map[COND_MAP_SIZE] = {};
+
+// 获取 cond 在本次 profile 中对应的表项，表项已被其它 cond 占用时返回 nullptr
+static CondMapEntry* get_cond_map_entry(const pthread_cond_t* cond) {
+    CondMapEntry& entry = g_cond_map[hash_mutex_ptr(cond) & (COND_MAP_SIZE - 1)];
+    const uint64_t version = g_cp_version & ((1 << (64 - PTR_BITS)) - 1);
+    const uint64_t desired = (version << PTR_BITS) | (uint64_t)cond;
+    uint64_t expected = entry.versioned_cond.load(std::memory_order_relaxed);
+    if (expected == desired) {
+        return &entry;
+    }
+    if (expected != 0 && (expected >> PTR_BITS) == version) {
+        return nullptr;
+    }
+    if (!entry.versioned_cond.compare_exchange_strong(expected, desired, std::memory_order_acquire)) {
+        return expected == desired ? &entry : nullptr;
+    }
+    entry.signal_time_ns.store(0, std::memory_order_relaxed);
+    entry.waiters.store(0, std::memory_order_relaxed);
+    entry.sampled_waiters.store(0, std::memory_order_relaxed);
+    entry.wakeup_generation.store(0, std::memory_order_relaxed);
+    entry.wakeup_stack.store_tagged(INVALID_STACK_ID, 0);
+    return &entry;
+}
+
+const size_t HOLDER_MAP_SIZE = 1024;
+struct HolderMapEntry {
+    std::atomic<uint64_t> versioned_lock;
+    // 最近一次解锁时有被采样的等待者的持有者的调用栈
+    StackSlot holder_stack;
+};
+// 锁的持有者信息，每次 profile 中一个表项被第一个映射到它的锁占用
+static HolderMapEntry g_holder_map[HOLDER_MAP_SIZE] = {};
+// 与 g_holder_map 下标相同，占用表项的锁正在等待的被采样的线程数，不为 0 时持有者解锁时保存调用栈
+// 单独放在紧凑的数组中，只在被采样的等待开始和结束时修改；解锁时先查这里，
+// 只有自己的锁有被采样的等待者时才访问 g_holder_map，其它锁上的等待不影响这个锁的解锁
+static std::atomic<int> g_holder_sampled_waiters[HOLDER_MAP_SIZE] = {};
+
+inline size_t get_holder_map_index(const void* lock) {
+    return hash_mutex_ptr(lock) & (HOLDER_MAP_SIZE - 1);
+}
+
+// 获取 lock 在本次 profile 中对应的表项
+// claim 为 true 时，表项空闲（或属于之前的 profile）则占用它；表项被其它锁占用时返回 nullptr
+static HolderMapEntry* get_holder_map_entry(const void* lock, bool claim) {
+    const size_t index = get_holder_map_index(lock);
+    HolderMapEntry& entry = g_holder_map[index];
+    const uint64_t version = g_cp_version & ((1 << (64 - PTR_BITS)) - 1);
+    const uint64_t desired = (version << PTR_BITS) | (uint64_t)lock;
+    uint64_t expected = entry.versioned_lock.load(std::memory_order_acquire);
+    if (expected == desired) {
+        return &entry;
+    }
+    if (!claim || (expected != 0 && (expected >> PTR_BITS) == version)) {
+        return nullptr;
+    }
+    if (!entry.versioned_lock.compare_exchange_strong(expected, desired, std::memory_order_acquire)) {
+        return expected == desired ? &entry : nullptr;
+    }
+    // 不重置 g_holder_sampled_waiters[index]：之前登记的等待者还会减掉自己加的计数，重置会使它变为负数，
+    // 掩盖之后的等待者；这些等待者结束前多算的计数只会让解锁时多保存几次调用栈
+    entry.holder_stack.store(INVALID_STACK_ID);
+    return &entry;
+}
+
+// 只有互斥锁的等待才有唯一的持有者可以归因
+inline bool is_holder_blame_kind(int kind) {
+    return kind == SAMPLE_KIND_MUTEX || kind == SAMPLE_KIND_TIMEDLOCK_ACQUIRED;
+}
+
+// 从 pthread_cond_wait 被唤醒返回后、解锁 mutex 之前的状态
+// 这期间如果又在同一个 cond 上等待，说明这次唤醒没有做任何事情，是一次无效唤醒
+struct TLSCondWakeup {
+    pthread_cond_t* cond;
+    pthread_mutex_t* mutex;
+    uint64_t cp_version;
+    uint64_t wakeup_time_ns;
+    // 被唤醒的那次等待的采样范围，为 0 时不统计无效唤醒
+    size_t sampling_range;
+    // 被唤醒时 cond 的 wakeup_generation，只接受以它保存的唤醒方调用栈
+    uint32_t wakeup_generation;
+};
+
+static __thread TLSCondWakeup tls_cond_wakeup = {nullptr, nullptr, 0, 0, 0, 0};
+
+// 从对象池中获取一个对象，按照采样率还原出实际的时间和次数
+static SampledContention* new_sampled_contention(const pthread_contention_site_t& csite, int events) {
     SampledContention* sc = get_object<SampledContention>();
+    sc->kind = csite.kind;
     sc->duration_ns = csite.duration_ns * COLLECTOR_SAMPLING_BASE / csite.sampling_range;
-    sc->count = COLLECTOR_SAMPLING_BASE / static_cast<double>(csite.sampling_range);
-    sc->frames_count = backtrace(sc->stack, sizeof(sc->stack) / sizeof(sc->stack[0]));
-    LOG(DEBUG) << "submit_contention: duration_ns: " << sc->duration_ns
-        << ", count: " << sc->count << ", frames_count: " << sc->frames_count;
-    sc->submit(now_ns / 1000);
+    sc->count = events * COLLECTOR_SAMPLING_BASE / static_cast<double>(csite.sampling_range);
+    sc->event_duration_ns = csite.duration_ns / events;
+    sc->time_us = Util::gettimeofday_us();
+    sc->tid = Util::get_tid();
+    return sc;
+}
+
+// 线程内的预聚合缓冲，(调用栈, 是否被截断, 采样类型, 直方图的桶) 相同的采样合并为一条记录，
+// 合并后直方图的结果不变，最长等待保留其中最长的一次
+// 每个线程一个缓冲，所有缓冲串成一个只增不删的链表，grab_thread 每一轮取走其中的记录交给 collector，
+// 结束 profile 时也会取走，线程之后没有采样时记录不会滞留。线程退出时放弃自己的缓冲，之后创建的线程优先复用
+// 记录的所有权通过槽位的 exchange 交接：取出非空指针的一方独占这条记录，所属线程合并时先取出再放回
+const int TLS_PENDING_SAMPLE_COUNT = 8;
+
+struct PendingSampleBuffer {
+    std::atomic<SampledContention*> slots[TLS_PENDING_SAMPLE_COUNT];
+    // 缓冲中的记录所属的 profile
+    std::atomic<uint64_t> cp_version;
+    std::atomic<bool> in_use;
+    PendingSampleBuffer* next;
+};
+
+// 槽位中记录的合并条件，只由所属线程读写，避免读取可能已经被 grab_thread 取走的记录
+struct PendingSampleKey {
+    bool used;
+    bool shallow_stack;
+    int kind;
+    int bucket;
+    uint32_t stack_id;
+};
+
+struct TLSPendingSamples {
+    PendingSampleBuffer* buffer;
+    // 所有槽位都在使用时，下一次替换的槽位
+    int next_victim;
+    PendingSampleKey keys[TLS_PENDING_SAMPLE_COUNT];
+};
+
+static std::atomic<PendingSampleBuffer*> g_pending_sample_buffers(nullptr);
+static __thread TLSPendingSamples tls_pending_samples = {nullptr, 0, {}};
+// 被合并到已有记录中的采样数
+static std::atomic<int64_t> g_pre_aggregated_samples(0);
+
+// 取出的记录属于当前的 profile 时交给 fn，否则销毁
+// 先读 cp_version 再取记录，所属线程切换 profile 的同时取到的记录宁可丢弃，也不要混入新的 profile
+template <typename Fn>
+static void take_pending_sample(PendingSampleBuffer* buffer, int i, const Fn& fn) {
+    const uint64_t cp_version = buffer->cp_version.load(std::memory_order_acquire);
+    SampledContention* sc = buffer->slots[i].exchange(nullptr, std::memory_order_acquire);
+    if (sc == nullptr) {
+        return;
+    }
+    if (cp_version == g_cp_version) {
+        fn(sc);
+    } else {
+        sc->destroy();
+    }
+}
+
+// 取出所有缓冲中的记录
+template <typename Fn>
+static void drain_pending_sample_buffers(const Fn& fn) {
+    for (PendingSampleBuffer* b = g_pending_sample_buffers.load(std::memory_order_acquire); b != nullptr;
+        b = b->next) {
+        for (int i = 0; i < TLS_PENDING_SAMPLE_COUNT; ++i) {
+            take_pending_sample(b, i, fn);
+        }
+    }
+}
+
+static void release_pending_sample_buffer() {
+    TLSPendingSamples& pending = tls_pending_samples;
+    // 缓冲中剩下的记录由 grab_thread 或者复用它的线程提交
+    pending.buffer->in_use.store(false, std::memory_order_release);
+    pending.buffer = nullptr;
+}
+
+static PendingSampleBuffer* get_pending_sample_buffer() {
+    TLSPendingSamples& pending = tls_pending_samples;
+    if (pending.buffer != nullptr) {
+        return pending.buffer;
+    }
+    PendingSampleBuffer* buffer = nullptr;
+    for (PendingSampleBuffer* b = g_pending_sample_buffers.load(std::memory_order_acquire); b != nullptr;
+        b = b->next) {
+        bool expected = false;
+        if (!b->in_use.load(std::memory_order_relaxed)
+            && b->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            buffer = b;
+            break;
+        }
+    }
+    if (buffer == nullptr) {
+        buffer = new (std::nothrow) PendingSampleBuffer;
+        if (buffer == nullptr) {
+            return nullptr;
+        }
+        for (auto& slot : buffer->slots) {
+            slot.store(nullptr, std::memory_order_relaxed);
+        }
+        buffer->cp_version.store(g_cp_version, std::memory_order_relaxed);
+        buffer->in_use.store(true, std::memory_order_relaxed);
+        buffer->next = g_pending_sample_buffers.load(std::memory_order_relaxed);
+        while (!g_pending_sample_buffers.compare_exchange_weak(buffer->next, buffer, std::memory_order_release)) {
+        }
+    }
+    thread_atexit(release_pending_sample_buffer);
+    pending.buffer = buffer;
+    pending.next_victim = 0;
+    for (auto& key : pending.keys) {
+        key.used = false;
+    }
+    return buffer;
+}
+
+/**
+ * @brief 提交一次采样，开启 sample_pre_aggregation 时先在线程内合并
+ *
+ * @param csite 竞争数据
+ * @param events 这次采样代表的事件数
+ * @param stack_id 调用栈的 ID
+ * @param shallow_stack 是否为 adaptive_stack_depth 下被截断的浅调用栈
+ * @param now_ns 当前时间
+ */
+static void submit_sample(const pthread_contention_site_t& csite, int events, uint32_t stack_id,
+    bool shallow_stack, int64_t now_ns) {
+    const int64_t now_us = now_ns / 1000;
+    PendingSampleBuffer* buffer = FLAGS_sample_pre_aggregation ? get_pending_sample_buffer() : nullptr;
+    if (buffer == nullptr) {
+        SampledContention* sc = new_sampled_contention(csite, events);
+        sc->stack_id = stack_id;
+        sc->shallow_stack = shallow_stack;
+        sc->submit(now_us);
+        return;
+    }
+    TLSPendingSamples& pending = tls_pending_samples;
+    auto submit = [now_us](SampledContention* sc) { sc->submit(now_us); };
+    // 开始了新的 profile，先取出之前的记录（之前的 profile 的直接销毁）
+    if (buffer->cp_version.load(std::memory_order_relaxed) != g_cp_version) {
+        for (int i = 0; i < TLS_PENDING_SAMPLE_COUNT; ++i) {
+            take_pending_sample(buffer, i, submit);
+            pending.keys[i].used = false;
+        }
+        buffer->cp_version.store(g_cp_version, std::memory_order_release);
+    }
+    const int64_t event_duration_ns = csite.duration_ns / events;
+    const int bucket = ContentionHistogram::get_bucket_index(event_duration_ns);
+    int free_slot = -1;
+    for (int i = 0; i < TLS_PENDING_SAMPLE_COUNT; ++i) {
+        PendingSampleKey& key = pending.keys[i];
+        if (!key.used) {
+            free_slot = free_slot < 0 ? i : free_slot;
+            continue;
+        }
+        if (key.stack_id != stack_id || key.kind != csite.kind || key.shallow_stack != shallow_stack
+            || key.bucket != bucket) {
+            continue;
+        }
+        SampledContention* sc = buffer->slots[i].exchange(nullptr, std::memory_order_acquire);
+        if (sc == nullptr) {
+            // 已经被 grab_thread 取走，在这个槽位中新建记录
+            key.used = false;
+            free_slot = i;
+            break;
+        }
+        sc->duration_ns += csite.duration_ns * COLLECTOR_SAMPLING_BASE / csite.sampling_range;
+        sc->count += events * COLLECTOR_SAMPLING_BASE / static_cast<double>(csite.sampling_range);
+        if (event_duration_ns > sc->event_duration_ns) {
+            sc->event_duration_ns = event_duration_ns;
+            sc->time_us = Util::gettimeofday_us();
+        }
+        buffer->slots[i].store(sc, std::memory_order_release);
+        g_pre_aggregated_samples.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    // 没有空闲的槽位时轮流替换，被替换的记录交给 collector
+    if (free_slot < 0) {
+        free_slot = pending.next_victim;
+        pending.next_victim = (pending.next_victim + 1) % TLS_PENDING_SAMPLE_COUNT;
+    }
+    SampledContention* sc = new_sampled_contention(csite, events);
+    sc->stack_id = stack_id;
+    sc->shallow_stack = shallow_stack;
+    pending.keys[free_slot] = {true, shallow_stack, csite.kind, bucket, stack_id};
+    // 槽位中可能还有记录：被替换的，或者复用缓冲时上一个线程留下的
+    SampledContention* old = buffer->slots[free_slot].exchange(sc, std::memory_order_acq_rel);
+    if (old != nullptr) {
+        old->submit(now_us);
+    }
+}
+
+void drain_pending_samples() {
+    const int64_t now_us = Util::get_monotonic_time_us();
+    drain_pending_sample_buffers([now_us](SampledContention* sc) { sc->submit(now_us); });
+}
+
+void flush_pending_samples(ContentionProfiler* cp) {
+    drain_pending_sample_buffers([cp](SampledContention* sc) { cp->dump_and_destroy(sc); });
+}
+
+// 采集调用栈时跳过 capture_stack_id、submit_contention、unlock_and_submit、xxx_impl 四层，
+// 调用栈从用户调用的加锁函数（hook_mutex.cpp 中的 hook）开始，之后是用户的调用者
+// 这几层都不能内联，也不能被优化为尾调用（参考 prevent_tail_call），否则优化编译时层数不固定，会多跳过用户的栈帧
+const int SKIPPED_STACK_FRAMES = 4;
+
+// 开启 adaptive_stack_depth 时，只采集了浅调用栈的采样数，以及浅调用栈已经变热而采集完整调用栈的采样数
+static std::atomic<int64_t> g_shallow_stack_samples(0);
+static std::atomic<int64_t> g_deepened_stack_samples(0);
+
+/**
+ * @brief 采集当前调用栈，返回它在 stack_table 中的 ID
+ * 开启 adaptive_stack_depth 并且 shallow 不为空时，先只采集 adaptive_stack_shallow_depth 层，
+ * 除非 ContentionProfiler 已经在本次 profile 中把这个浅调用栈标记为热点（标记为 g_cp_version）
+ * 开启 stack_memo 时先只展开最内层的几帧，与栈指针的位置一起查找线程内的缓存，命中时不做完整展开
+ * 只由 submit_contention、save_current_stack 和 publish_current_stack 调用，调用层次相同
+ *
+ * @param shallow 为空时总是采集完整的调用栈，否则输出返回的是否为被截断的浅调用栈
+ * @return uint32_t 调用栈的 ID，采集失败时返回 INVALID_STACK_ID
+ */
+__attribute__((noinline)) static uint32_t capture_stack_id(bool* shallow) {
+    const int depth = get_sampled_stack_depth();
+    const int skip = SKIPPED_STACK_FRAMES + get_sampled_stack_skip();
+    void* stack[MAX_STACK_FRAMES];
+    if (shallow != nullptr && FLAGS_adaptive_stack_depth) {
+        const int shallow_depth = std::max(1, std::min<int>(FLAGS_adaptive_stack_shallow_depth, depth));
+        const int frames_count = get_stack_trace(stack, shallow_depth, skip);
+        const uint32_t shallow_id = intern_stack(stack, frames_count);
+        // 没有填满时已经是完整的调用栈
+        if (frames_count < shallow_depth || shallow_depth == depth) {
+            return shallow_id;
+        }
+        if (shallow_id != INVALID_STACK_ID && get_interned_stack_mark(shallow_id) != g_cp_version) {
+            g_shallow_stack_samples.fetch_add(1, std::memory_order_relaxed);
+            *shallow = true;
+            return shallow_id;
+        }
+        g_deepened_stack_samples.fetch_add(1, std::memory_order_relaxed);
+    }
+    const StackBounds& bounds = get_current_stack_bounds();
+    if (!is_stack_memo_enabled() || bounds.low == bounds.high) {
+        return intern_stack(stack, get_stack_trace(stack, depth, skip));
+    }
+    StackMemoKey key;
+    key.frames_count = get_stack_trace(key.frames, std::min(depth, STACK_MEMO_KEY_FRAMES), skip);
+    key.stack_offset = bounds.high - reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+    key.depth = depth;
+    key.skip = skip;
+    bool need_verify = false;
+    const uint32_t stack_id = lookup_stack_memo(key, &need_verify);
+    if (stack_id != INVALID_STACK_ID && !need_verify) {
+        return stack_id;
+    }
+    const uint32_t full_stack_id = intern_stack(stack, get_stack_trace(stack, depth, skip));
+    update_stack_memo(key, full_stack_id, stack_id != INVALID_STACK_ID);
+    return full_stack_id;
+}
+
+/**
+ * @brief 采集当前调用栈并提交，注意这个函数在锁外执行
+ *
+ * @param csite 竞争数据
+ * @param now_ns 当前时间
+ * @param events 这次采样代表的事件数，比如一次 broadcast 唤醒的等待者数量
+ * @param saved_stack 不为空时，同时把调用栈以 saved_stack_tag 保存到这里，供其它线程使用
+ * @param saved_stack_tag 参考 StackSlot::store_tagged
+ */
+__attribute__((noinline)) void submit_contention(const pthread_contention_site_t& csite, int64_t now_ns,
+    int events = 1, StackSlot* saved_stack = nullptr, uint32_t saved_stack_tag = 0) {
+    // 使用 TLS 进行加锁，收集锁竞争的代码中可能会调用 pthread_mutex_lock
+    tls_inside_lock = true;
+    bool shallow_stack = false;
+    // 保存给其它线程的调用栈总是完整的
+    const uint32_t stack_id = capture_stack_id(saved_stack == nullptr ? &shallow_stack : nullptr);
+    if (saved_stack != nullptr) {
+        saved_stack->store_tagged(stack_id, saved_stack_tag);
+    }
+    LOG(DEBUG) << "submit_contention: kind: " << get_sample_kind_name(csite.kind)
+        << ", duration_ns: " << csite.duration_ns << ", events: " << events << ", stack_id: " << stack_id;
+    submit_sample(csite, events, stack_id, shallow_stack, now_ns);
     tls_inside_lock = false;
 }
 
-int pthread_mutex_lock_impl(pthread_mutex_t* mutex) {
-    // 在 ld 链接加载的时候，有可能 constructor 还没有被调用，这里调用一次
-    if (__glibc_unlikely(real_pthread_mutex_lock_func == nullptr)) {
-        mutex_hook_init();
+// 使用已经保存的调用栈提交，不采集当前调用栈，调用栈无效时不提交
+static void submit_contention_with_stack(const pthread_contention_site_t& csite, int64_t now_ns,
+    uint32_t stack_id) {
+    if (stack_id == INVALID_STACK_ID) {
+        return;
     }
-    // 收集锁竞争信息的代码可能会调用 pthread_mutex_lock，并且可能会造成死锁，因此不采样
-    if (!g_cp || tls_inside_lock) {
-        return real_pthread_mutex_lock_func(mutex);
+    tls_inside_lock = true;
+    submit_sample(csite, 1, stack_id, false, now_ns);
+    tls_inside_lock = false;
+}
+
+// 把当前调用栈保存到 slot 中，调用层次与 submit_contention 相同
+__attribute__((noinline)) static void save_current_stack(StackSlot* slot) {
+    tls_inside_lock = true;
+    slot->store(capture_stack_id(nullptr));
+    tls_inside_lock = false;
+}
+
+// 同上，以 tag 保存，参考 StackSlot::store_tagged
+__attribute__((noinline)) static void save_current_stack(StackSlot* slot, uint32_t tag) {
+    tls_inside_lock = true;
+    slot->store_tagged(capture_stack_id(nullptr), tag);
+    tls_inside_lock = false;
+}
+
+// 同上，以 slot->reserve() 预留的 seq 保存，参考 StackSlot::publish
+__attribute__((noinline)) static void publish_current_stack(StackSlot* slot, uint32_t seq) {
+    tls_inside_lock = true;
+    slot->publish(seq, capture_stack_id(nullptr));
+    tls_inside_lock = false;
+}
+
+// 所有线程共用的空闲 chunk 链表，(tag << PTR_BITS) | 指针，tag 防止 ABA
+// chunk 由 mmap 批量分配，不会释放，因此读取已被其它线程取走的 chunk 的 next 是安全的
+static std::atomic<uint64_t> g_free_tls_chunks(0);
+const size_t TLS_CHUNKS_PER_BLOCK = 64;
+// TLS 和所有 chunk 都已用满，只能使用 g_mutex_map 的次数
+static std::atomic<int64_t> g_tls_site_overflows(0);
+static std::atomic<int64_t> g_lock_depth_histogram[LOCK_DEPTH_HISTOGRAM_SIZE] = {};
+
+static void push_free_tls_chunk(TLSContentionSiteChunk* chunk) {
+    const uint64_t ptr_mask = (((uint64_t)1) << PTR_BITS) - 1;
+    uint64_t head = g_free_tls_chunks.load(std::memory_order_relaxed);
+    uint64_t desired;
+    do {
+        chunk->next = reinterpret_cast<TLSContentionSiteChunk*>(head & ptr_mask);
+        desired = (((head >> PTR_BITS) + 1) << PTR_BITS) | (uint64_t)chunk;
+    } while (!g_free_tls_chunks.compare_exchange_weak(head, desired, std::memory_order_release));
+}
+
+// 从空闲链表中取一个 chunk，链表为空时用 mmap 分配一批，不调用 malloc
+static TLSContentionSiteChunk* pop_free_tls_chunk() {
+    const uint64_t ptr_mask = (((uint64_t)1) << PTR_BITS) - 1;
+    uint64_t head = g_free_tls_chunks.load(std::memory_order_acquire);
+    while (head & ptr_mask) {
+        TLSContentionSiteChunk* chunk = reinterpret_cast<TLSContentionSiteChunk*>(head & ptr_mask);
+        const uint64_t desired = (((head >> PTR_BITS) + 1) << PTR_BITS) | (uint64_t)chunk->next;
+        if (g_free_tls_chunks.compare_exchange_weak(head, desired, std::memory_order_acquire)) {
+            return chunk;
+        }
     }
-    // 对于没有竞争的锁，直接放行，不要减慢人家的速度
-    int res = pthread_mutex_trylock(mutex);
-    if (res != EBUSY) {
-        // EBUSY 表示 mutex 所指向的互斥锁已锁定，无法获取，有竞争
-        return res;
+    void* mem = mmap(nullptr, sizeof(TLSContentionSiteChunk) * TLS_CHUNKS_PER_BLOCK,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return nullptr;
     }
-    LOG(DEBUG) << "start sampling";
-    const size_t sampling_range = is_collectable(&g_cp_sl);
+    TLSContentionSiteChunk* chunks = static_cast<TLSContentionSiteChunk*>(mem);
+    for (size_t i = 1; i < TLS_CHUNKS_PER_BLOCK; ++i) {
+        push_free_tls_chunk(&chunks[i]);
+    }
+    return &chunks[0];
+}
+
+// 线程退出时归还借用的 chunk
+static void return_tls_chunks() {
+    TLSPthreadContentionSites& fast_alt = tls_csites;
+    for (int i = 0; i < TLS_MAX_CHUNKS && fast_alt.chunks[i] != nullptr; ++i) {
+        push_free_tls_chunk(fast_alt.chunks[i]);
+        fast_alt.chunks[i] = nullptr;
+    }
+    fast_alt.count = 0;
+}
+
+// 登记项超出当前容量时借用一个 chunk，第一次借用时注册线程退出的回调
+static bool grow_tls_contention_sites(TLSPthreadContentionSites& fast_alt) {
+    int n = 0;
+    while (n < TLS_MAX_CHUNKS && fast_alt.chunks[n] != nullptr) {
+        ++n;
+    }
+    if (n == TLS_MAX_CHUNKS) {
+        return false;
+    }
+    const bool saved_inside_lock = tls_inside_lock;
+    tls_inside_lock = true;
+    if (n == 0) {
+        thread_atexit(return_tls_chunks);
+    }
+    fast_alt.chunks[n] = pop_free_tls_chunk();
+    tls_inside_lock = saved_inside_lock;
+    return fast_alt.chunks[n] != nullptr;
+}
 
-    pthread_contention_site_t* csite = nullptr;
+// 获取当前线程的登记项，开始新的 profile 后之前的登记项和锁的计数都作废
+inline TLSPthreadContentionSites& get_tls_csites() {
     TLSPthreadContentionSites& fast_alt = tls_csites;
-    if (fast_alt.cp_version != g_cp_version) {
+    if (__glibc_unlikely(fast_alt.cp_version != g_cp_version)) {
         fast_alt.cp_version = g_cp_version;
         fast_alt.count = 0;
+        fast_alt.lock_depth = 0;
+        fast_alt.global_count = 0;
     }
-    if (fast_alt.count < TLS_MAX_COUNT) {
-        MutexAndContentionSite& entry = fast_alt.list[fast_alt.count++];
-        entry.mutex = mutex;
-        csite = &entry.csite;
-        if (!sampling_range) {
-            make_contention_site_invalid(&entry.csite);
-            return real_pthread_mutex_lock_func(mutex);
-        }
+    return fast_alt;
+}
+
+// 记录被采样的加锁发生时的锁嵌套深度（包括这次加的锁）
+static void record_lock_depth(int depth) {
+    const int index = depth < LOCK_DEPTH_HISTOGRAM_SIZE ? depth : LOCK_DEPTH_HISTOGRAM_SIZE - 1;
+    g_lock_depth_histogram[index].fetch_add(1, std::memory_order_relaxed);
+}
+
+// 在 TLS 中登记发生竞争的锁，TLS 已满时返回 nullptr
+// 未被采样的锁也要登记，这样解锁时可以在 TLS 中命中，不必去查 g_mutex_map
+static MutexAndContentionSite* add_tls_contention_site(void* lock, size_t sampling_range) {
+    TLSPthreadContentionSites& fast_alt = get_tls_csites();
+    if (fast_alt.count >= TLS_INLINE_COUNT
+        && (fast_alt.count - TLS_INLINE_COUNT) / TLS_CHUNK_SIZE >= TLS_MAX_CHUNKS) {
+        g_tls_site_overflows.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    if (fast_alt.count >= TLS_INLINE_COUNT && (fast_alt.count - TLS_INLINE_COUNT) % TLS_CHUNK_SIZE == 0
+        && fast_alt.chunks[(fast_alt.count - TLS_INLINE_COUNT) / TLS_CHUNK_SIZE] == nullptr
+        && !grow_tls_contention_sites(fast_alt)) {
+        g_tls_site_overflows.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
     }
+    MutexAndContentionSite& entry = fast_alt.at(fast_alt.count++);
+    entry.lock = lock;
     if (!sampling_range) {
-        return real_pthread_mutex_lock_func(mutex);
+        make_contention_site_invalid(&entry.csite);
     }
-    const uint64_t start_time_ns = Util::get_monotonic_time_ns();
-    res = real_pthread_mutex_lock_func(mutex);
-    if (res == 0) {
-        if (csite == nullptr) {
-            csite = add_pthread_contention_site(mutex);
-            if (csite == nullptr) {
-                return res;
-            }
+    make_contention_site_invalid(&entry.hold_csite);
+    return &entry;
+}
+
+// 加锁失败时撤销 add_tls_contention_site 的登记，此时 entry 一定是最后一个登记项
+static void remove_tls_contention_site(MutexAndContentionSite* entry) {
+    TLSPthreadContentionSites& fast_alt = tls_csites;
+    if (entry != nullptr && fast_alt.count > 0 && entry == &fast_alt.at(fast_alt.count - 1)) {
+        --fast_alt.count;
+    }
+}
+
+/**
+ * @brief 加锁成功后开始记录持有时间，解锁时提交 SAMPLE_KIND_HOLD
+ *
+ * 持有时间使用单独的 g_hold_sl，每次加锁都会参与采样，不能占用等待采样的配额
+ *
+ * @param entry lock 在 TLS 中的登记项，为 nullptr 时（TLS 已满）不记录
+ * @param sampling_range 调用方已经按 g_hold_sl 决定的采样结果，为 0 时在这里决定是否采样
+ */
+static void start_hold_time(MutexAndContentionSite* entry, size_t sampling_range = 0) {
+    if (entry == nullptr) {
+        return;
+    }
+    if (!sampling_range) {
+        sampling_range = is_collectable(&g_hold_sl, entry->lock);
+        if (!sampling_range) {
+            return;
         }
-        csite->duration_ns = Util::get_monotonic_time_ns() - start_time_ns;
-        csite->sampling_range = sampling_range;
     }
-    return res;
+    entry->hold_csite = {0, sampling_range, SAMPLE_KIND_HOLD};
+    entry->hold_start_ns = Util::get_monotonic_time_ns();
 }
 
-int pthread_mutex_unlock_impl(pthread_mutex_t* mutex) {
-    if (__glibc_unlikely(real_pthread_mutex_unlock_func == nullptr)) {
-        mutex_hook_init();
+// 没有竞争、trylock 直接成功，计数持有的锁；打开 hold_time_profile 时采样持有时间，只有被采样时才在 TLS 中登记
+static void on_uncontended_lock(void* lock) {
+    TLSPthreadContentionSites& fast_alt = get_tls_csites();
+    ++fast_alt.lock_depth;
+    if (!FLAGS_hold_time_profile) {
+        return;
     }
-    if (!g_cp || tls_inside_lock) {
-        return real_pthread_mutex_unlock_func(mutex);
+    const size_t sampling_range = is_collectable(&g_hold_sl, lock);
+    if (sampling_range) {
+        record_lock_depth(fast_alt.lock_depth);
+        start_hold_time(add_tls_contention_site(lock, 0), sampling_range);
     }
-    uint64_t unlock_start_time_ns = 0;
-    bool miss_in_tls = true;
-    pthread_contention_site_t saved_csite = {0, 0};
-    TLSPthreadContentionSites& fast_alt = tls_csites;
+}
+
+// 在 TLS 中查找 mutex 被采样的持有时间，pthread_cond_wait 期间 mutex 被释放，不计入持有时间
+static MutexAndContentionSite* find_tls_hold_site(pthread_mutex_t* mutex) {
+    TLSPthreadContentionSites& fast_alt = get_tls_csites();
     for (int i = fast_alt.count - 1; i >= 0; --i) {
-        if (fast_alt.list[i].mutex == mutex) {
-            if (is_contention_site_valid(fast_alt.list[i].csite)) {
-                saved_csite = fast_alt.list[i].csite;
-                unlock_start_time_ns = Util::get_monotonic_time_ns();
-            }
-            fast_alt.list[i] = fast_alt.list[--fast_alt.count];
-            miss_in_tls = false;
-            break;
+        MutexAndContentionSite& entry = fast_alt.at(i);
+        if (entry.lock == mutex) {
+            return is_contention_site_valid(entry.hold_csite) ? &entry : nullptr;
         }
     }
-    if (miss_in_tls) {
-        if (remove_pthread_contention_site(mutex, &saved_csite)) {
-            unlock_start_time_ns = Util::get_monotonic_time_ns();
-        }
+    return nullptr;
+}
+
+const int NO_TIMEOUT = -1;
+
+/**
+ * @brief duration_sampling 下按等待时间决定是否采样（重要性采样）
+ * 不短于 duration_sampling_threshold_us 的等待全部保留，更短的以与等待时间成正比的概率保留
+ * 返回的采样范围与实际保留的概率一致，按它还原后的时间和次数是无偏的
+ *
+ * @param duration_ns 等待时间
+ * @return size_t 保留时返回采样范围，不保留时返回 0
+ */
+static size_t get_duration_sampling_range(uint64_t duration_ns) {
+    const uint64_t threshold_ns = static_cast<uint64_t>(std::max(FLAGS_duration_sampling_threshold_us, 0)) * 1000;
+    if (duration_ns >= threshold_ns) {
+        return COLLECTOR_SAMPLING_BASE;
     }
-    int res = real_pthread_mutex_unlock_func(mutex);
-    // 注意: 这里往下属于锁外
-    if (unlock_start_time_ns) {
-        uint64_t unlock_end_time_ns = Util::get_monotonic_time_ns();
-        saved_csite.duration_ns += unlock_end_time_ns - unlock_start_time_ns;
-        submit_contention(saved_csite, unlock_end_time_ns);
+    size_t sampling_range = duration_ns * COLLECTOR_SAMPLING_BASE / threshold_ns;
+    if (sampling_range == 0) {
+        sampling_range = 1;
     }
-    return res;
+    if ((fast_rand() & (COLLECTOR_SAMPLING_BASE - 1)) >= sampling_range) {
+        return 0;
+    }
+    return sampling_range;
+}
+
+/**
+ * @brief trylock 失败后的慢路径：决定是否采样，阻塞加锁，并记录等待时间
+ *
+ * 带超时的加锁，超时返回时没有持有锁，不会再有解锁，因此立即提交
+ * 不能内联，调用栈中要固定占一层，参考 SKIPPED_STACK_FRAMES
+ *
+ * @param lock 锁
+ * @param real_lock_func 真正的加锁函数，参数为 lock
+ * @param kind 采样类型
+ * @param shared 是否为共享锁（读锁）。共享锁可能同时被多个线程持有，
+ *        g_mutex_map 无法区分持有者，因此只使用 TLS 记录
+ * @param timedout_res real_lock_func 超时的返回值，不带超时的加锁为 NO_TIMEOUT
+ * @return int
+ */
+template <typename T, typename F>
+__attribute__((noinline)) static int contended_lock(T* lock, F real_lock_func, int kind, bool shared,
+    int timedout_res = NO_TIMEOUT) {
+    LOG(DEBUG) << "start sampling";
+    // 自旋锁统计消耗的 CPU 周期，其它锁统计等待的时间
+    const bool use_cpu_cycles = is_cpu_cycles_sample_kind(kind);
+    // duration_sampling 下每次竞争都计时，等待结束后再决定是否采样，在此之前按被采样处理
+    // 持有者在解锁时才知道有没有需要归因的等待者，这时无法提前决定，因此不做持有者的归因
+    const bool by_duration = FLAGS_duration_sampling && !use_cpu_cycles;
+    size_t sampling_range = by_duration ? COLLECTOR_SAMPLING_BASE : is_collectable(&g_cp_sl, lock);
+    MutexAndContentionSite* tls_site = add_tls_contention_site(lock, sampling_range);
+    pthread_contention_site_t* csite = tls_site != nullptr ? &tls_site->csite : nullptr;
+    if (!sampling_range) {
+        int res = real_lock_func(lock);
+        if (res != 0) {
+            remove_tls_contention_site(tls_site);
+            return res;
+        }
+        ++tls_csites.lock_depth;
+        if (FLAGS_hold_time_profile) {
+            start_hold_time(tls_site);
+        }
+        return res;
+    }
+    // 登记为等待者，持有者解锁时看到后会保存它的调用栈
+    HolderMapEntry* holder_entry = !by_duration && is_holder_blame_kind(kind)
+        ? get_holder_map_entry(lock, true) : nullptr;
+    uint32_t holder_stack_seq = 0;
+    std::atomic<int>* holder_sampled_waiters = nullptr;
+    if (holder_entry != nullptr) {
+        holder_sampled_waiters = &g_holder_sampled_waiters[get_holder_map_index(lock)];
+        holder_sampled_waiters->fetch_add(1, std::memory_order_relaxed);
+        holder_stack_seq = holder_entry->holder_stack.get_seq();
+    }
+    const uint64_t start_time = use_cpu_cycles ? Util::get_cpu_cycles() : Util::get_monotonic_time_ns();
+    int res = real_lock_func(lock);
+    if (holder_sampled_waiters != nullptr) {
+        holder_sampled_waiters->fetch_sub(1, std::memory_order_relaxed);
+    }
+    if (by_duration) {
+        sampling_range = get_duration_sampling_range(Util::get_monotonic_time_ns() - start_time);
+        // 不保留时与一开始就不采样的处理相同
+        if (!sampling_range) {
+            if (res != 0) {
+                remove_tls_contention_site(tls_site);
+                return res;
+            }
+            if (tls_site != nullptr) {
+                make_contention_site_invalid(&tls_site->csite);
+            }
+            ++tls_csites.lock_depth;
+            if (FLAGS_hold_time_profile) {
+                start_hold_time(tls_site);
+            }
+            return res;
+        }
+    }
+    if (res != 0) {
+        remove_tls_contention_site(tls_site);
+        if (res == timedout_res) {
+            const uint64_t now_ns = Util::get_monotonic_time_ns();
+            pthread_contention_site_t timedout_csite = {
+                static_cast<int64_t>(now_ns - start_time), sampling_range, SAMPLE_KIND_TIMEDLOCK_TIMEDOUT};
+            submit_contention(timedout_csite, now_ns);
+        }
+        return res;
+    }
+    record_lock_depth(++tls_csites.lock_depth);
+    if (FLAGS_hold_time_profile) {
+        // 等待和持有时间各自决定是否采样，等待被采样不代表持有时间也被采样
+        start_hold_time(tls_site);
+    }
+    if (csite == nullptr) {
+        if (shared) {
+            return res;
+        }
+        csite = add_pthread_contention_site(lock);
+        if (csite == nullptr) {
+            return res;
+        }
+        ++tls_csites.global_count;
+    }
+    csite->duration_ns = (use_cpu_cycles ? Util::get_cpu_cycles() : Util::get_monotonic_time_ns()) - start_time;
+    csite->sampling_range = sampling_range;
+    csite->kind = kind;
+    csite->holder_stack_seq = holder_stack_seq;
+    return res;
+}
+
+/**
+ * @brief 解锁，如果持有的锁之前被采样过，则在锁外提交竞争数据
+ *
+ * 同一次等待提交两份数据：SAMPLE_KIND_MUTEX 使用等待者自己的调用栈（谁在等），
+ * SAMPLE_KIND_MUTEX_HOLDER 使用持有者解锁时保存的调用栈（谁让它等）
+ * 如果有被采样的等待者，当前线程也作为持有者保存自己的调用栈：为了不在临界区内展开调用栈，
+ * 真正解锁前只预留 holder_stack 的 seq，解锁后再采集并 publish；
+ * 等待者解锁时读到已预留但还没 publish 的 seq，就在锁外提交完自己的数据后再按这个 seq 读一次，
+ * 仍然没有 publish（或者已被下一个持有者覆盖）时放弃这次持有者的采样
+ * 不能内联，调用栈中要固定占一层，参考 SKIPPED_STACK_FRAMES
+ *
+ * @param lock 锁
+ * @param real_unlock_func 真正的解锁函数，参数为 lock
+ * @return int
+ */
+template <typename T, typename F>
+__attribute__((noinline)) static int unlock_and_submit(T* lock, F real_unlock_func) {
+    uint64_t unlock_start_time_ns = 0;
+    bool miss_in_tls = true;
+    pthread_contention_site_t saved_csite = {0, 0, 0};
+    pthread_contention_site_t saved_hold_csite = {0, 0, 0};
+    TLSCondWaitSite saved_cond_site = {nullptr, 0, {0, 0, 0}, {0, 0, 0}};
+    if (tls_cond_site.mutex == static_cast<void*>(lock)) {
+        saved_cond_site = tls_cond_site;
+        tls_cond_site.mutex = nullptr;
+    }
+    // 被唤醒后解锁了 mutex，说明做了事情，不是无效唤醒
+    if (tls_cond_wakeup.mutex == static_cast<void*>(lock)) {
+        tls_cond_wakeup.cond = nullptr;
+        tls_cond_wakeup.mutex = nullptr;
+    }
+    TLSPthreadContentionSites& fast_alt = get_tls_csites();
+    if (fast_alt.lock_depth > 0) {
+        --fast_alt.lock_depth;
+    }
+    for (int i = fast_alt.count - 1; i >= 0; --i) {
+        MutexAndContentionSite& entry = fast_alt.at(i);
+        if (entry.lock == lock) {
+            if (is_contention_site_valid(entry.csite)) {
+                saved_csite = entry.csite;
+                unlock_start_time_ns = Util::get_monotonic_time_ns();
+            }
+            if (is_contention_site_valid(entry.hold_csite)) {
+                saved_hold_csite = entry.hold_csite;
+                saved_hold_csite.duration_ns += Util::get_monotonic_time_ns() - entry.hold_start_ns;
+            }
+            entry = fast_alt.at(--fast_alt.count);
+            miss_in_tls = false;
+            break;
+        }
+    }
+    if (miss_in_tls && fast_alt.global_count > 0) {
+        if (remove_pthread_contention_site(lock, &saved_csite)) {
+            --fast_alt.global_count;
+            unlock_start_time_ns = Util::get_monotonic_time_ns();
+        }
+    }
+    // 这个锁没有被采样的等待者，并且自己的等待不需要归因到持有者时，不查 g_holder_map
+    HolderMapEntry* holder_entry = nullptr;
+    const bool has_sampled_waiters =
+        g_holder_sampled_waiters[get_holder_map_index(lock)].load(std::memory_order_relaxed) > 0;
+    if (has_sampled_waiters || (unlock_start_time_ns && is_holder_blame_kind(saved_csite.kind))) {
+        holder_entry = get_holder_map_entry(lock, false);
+    }
+    bool save_holder_stack = false;
+    uint32_t holder_stack_id = INVALID_STACK_ID;
+    // 等待者读到的持有者调用栈的 seq，持有者还没有 publish 时在锁外再读一次
+    uint32_t pending_holder_seq = 0;
+    bool holder_stack_pending = false;
+    // 作为持有者为自己预留的 seq
+    uint32_t reserved_holder_seq = 0;
+    if (holder_entry != nullptr) {
+        // 表项属于这个锁时，计数中除了这个锁的等待者，只可能还有之前占用表项的锁上尚未结束的等待者
+        save_holder_stack = has_sampled_waiters;
+        if (unlock_start_time_ns && is_holder_blame_kind(saved_csite.kind)) {
+            holder_stack_id = holder_entry->holder_stack.load(saved_csite.holder_stack_seq, &pending_holder_seq);
+            holder_stack_pending =
+                holder_stack_id == INVALID_STACK_ID && pending_holder_seq != saved_csite.holder_stack_seq;
+        }
+    }
+    if (save_holder_stack) {
+        reserved_holder_seq = holder_entry->holder_stack.reserve();
+    }
+    int res = real_unlock_func(lock);
+    // 注意: 这里往下属于锁外
+    if (save_holder_stack) {
+        publish_current_stack(&holder_entry->holder_stack, reserved_holder_seq);
+    }
+    if (unlock_start_time_ns) {
+        uint64_t unlock_end_time_ns = Util::get_monotonic_time_ns();
+        // 以 CPU 周期为单位的数据不能再加上解锁的纳秒数，自旋锁的解锁也只是一次写操作
+        if (!is_cpu_cycles_sample_kind(saved_csite.kind)) {
+            saved_csite.duration_ns += unlock_end_time_ns - unlock_start_time_ns;
+        }
+        submit_contention(saved_csite, unlock_end_time_ns);
+        if (holder_stack_pending) {
+            holder_stack_id = holder_entry->holder_stack.load_tagged(pending_holder_seq);
+        }
+        if (holder_stack_id != INVALID_STACK_ID) {
+            saved_csite.kind = SAMPLE_KIND_MUTEX_HOLDER;
+            submit_contention_with_stack(saved_csite, unlock_end_time_ns, holder_stack_id);
+        }
+    }
+    if (is_contention_site_valid(saved_hold_csite)) {
+        submit_contention(saved_hold_csite, Util::get_monotonic_time_ns());
+    }
+    if (saved_cond_site.mutex != nullptr && saved_cond_site.cp_version == g_cp_version) {
+        uint64_t now_ns = Util::get_monotonic_time_ns();
+        submit_contention(saved_cond_site.signal_csite, now_ns);
+        if (saved_cond_site.reacquire_csite.duration_ns > 0) {
+            submit_contention(saved_cond_site.reacquire_csite, now_ns);
+        }
+    }
+    return res;
+}
+
+__attribute__((noinline)) int pthread_mutex_lock_impl(pthread_mutex_t* mutex) {
+    // 在 ld 链接加载的时候，有可能 constructor 还没有被调用，这里调用一次
+    if (__glibc_unlikely(real_pthread_mutex_lock_func == nullptr)) {
+        mutex_hook_init();
+    }
+    // 收集锁竞争信息的代码可能会调用 pthread_mutex_lock，并且可能会造成死锁，因此不采样
+    if (!g_cp || tls_inside_lock) {
+        return real_pthread_mutex_lock_func(mutex);
+    }
+    // 对于没有竞争的锁，直接放行，不要减慢人家的速度
+    int res = pthread_mutex_trylock(mutex);
+    if (res != EBUSY) {
+        // EBUSY 表示 mutex 所指向的互斥锁已锁定，无法获取，有竞争
+        if (res == 0) {
+            on_uncontended_lock(mutex);
+        }
+        return res;
+    }
+    res = contended_lock(mutex, real_pthread_mutex_lock_func, SAMPLE_KIND_MUTEX, false);
+    prevent_tail_call(res);
+    return res;
+}
+
+__attribute__((noinline)) int pthread_mutex_unlock_impl(pthread_mutex_t* mutex) {
+    if (__glibc_unlikely(real_pthread_mutex_unlock_func == nullptr)) {
+        mutex_hook_init();
+    }
+    if (!g_cp || tls_inside_lock) {
+        return real_pthread_mutex_unlock_func(mutex);
+    }
+    int res = unlock_and_submit(mutex, real_pthread_mutex_unlock_func);
+    prevent_tail_call(res);
+    return res;
+}
+
+__attribute__((noinline)) int pthread_mutex_timedlock_impl(pthread_mutex_t* mutex, const struct timespec* abstime) {
+    if (__glibc_unlikely(real_pthread_mutex_timedlock_func == nullptr)) {
+        mutex_hook_init();
+    }
+    if (!g_cp || tls_inside_lock) {
+        return real_pthread_mutex_timedlock_func(mutex, abstime);
+    }
+    int res = pthread_mutex_trylock(mutex);
+    if (res != EBUSY) {
+        if (res == 0) {
+            on_uncontended_lock(mutex);
+        }
+        return res;
+    }
+    res = contended_lock(mutex, [abstime](pthread_mutex_t* m) {
+        return real_pthread_mutex_timedlock_func(m, abstime);
+    }, SAMPLE_KIND_TIMEDLOCK_ACQUIRED, false, ETIMEDOUT);
+    prevent_tail_call(res);
+    return res;
+}
+
+__attribute__((noinline)) int pthread_mutex_clocklock_impl(pthread_mutex_t* mutex, clockid_t clockid,
+    const struct timespec* abstime) {
+    if (__glibc_unlikely(real_pthread_mutex_clocklock_func == nullptr)) {
+        mutex_hook_init();
+        // glibc 2.30 之前没有 pthread_mutex_clocklock
+        if (real_pthread_mutex_clocklock_func == nullptr) {
+            return ENOSYS;
+        }
+    }
+    if (!g_cp || tls_inside_lock) {
+        return real_pthread_mutex_clocklock_func(mutex, clockid, abstime);
+    }
+    int res = pthread_mutex_trylock(mutex);
+    if (res != EBUSY) {
+        if (res == 0) {
+            on_uncontended_lock(mutex);
+        }
+        return res;
+    }
+    res = contended_lock(mutex, [clockid, abstime](pthread_mutex_t* m) {
+        return real_pthread_mutex_clocklock_func(m, clockid, abstime);
+    }, SAMPLE_KIND_TIMEDLOCK_ACQUIRED, false, ETIMEDOUT);
+    prevent_tail_call(res);
+    return res;
+}
+
+// C11 的 mtx_* 在 glibc 内部直接调用 pthread_mutex_*，不经过上面的 hook，需要单独处理
+// 返回值为 thrd_success(0)、thrd_busy、thrd_timedout 等
+// glibc 2.28 之前没有 C11 threads，dlsym 拿不到时返回 thrd_error
+__attribute__((noinline)) int mtx_lock_impl(mtx_t* mtx) {
+    if (__glibc_unlikely(real_mtx_lock_func == nullptr || real_mtx_trylock_func == nullptr)) {
+        mutex_hook_init();
+        if (real_mtx_lock_func == nullptr || real_mtx_trylock_func == nullptr) {
+            return thrd_error;
+        }
+    }
+    if (!g_cp || tls_inside_lock) {
+        return real_mtx_lock_func(mtx);
+    }
+    int res = real_mtx_trylock_func(mtx);
+    if (res != thrd_busy) {
+        if (res == 0) {
+            on_uncontended_lock(mtx);
+        }
+        return res;
+    }
+    res = contended_lock(mtx, real_mtx_lock_func, SAMPLE_KIND_MUTEX, false);
+    prevent_tail_call(res);
+    return res;
+}
+
+__attribute__((noinline)) int mtx_timedlock_impl(mtx_t* mtx, const struct timespec* time_point) {
+    if (__glibc_unlikely(real_mtx_timedlock_func == nullptr || real_mtx_trylock_func == nullptr)) {
+        mutex_hook_init();
+        if (real_mtx_timedlock_func == nullptr || real_mtx_trylock_func == nullptr) {
+            return thrd_error;
+        }
+    }
+    if (!g_cp || tls_inside_lock) {
+        return real_mtx_timedlock_func(mtx, time_point);
+    }
+    int res = real_mtx_trylock_func(mtx);
+    if (res != thrd_busy) {
+        if (res == 0) {
+            on_uncontended_lock(mtx);
+        }
+        return res;
+    }
+    res = contended_lock(mtx, [time_point](mtx_t* m) {
+        return real_mtx_timedlock_func(m, time_point);
+    }, SAMPLE_KIND_TIMEDLOCK_ACQUIRED, false, thrd_timedout);
+    prevent_tail_call(res);
+    return res;
+}
+
+__attribute__((noinline)) int mtx_unlock_impl(mtx_t* mtx) {
+    if (__glibc_unlikely(real_mtx_unlock_func == nullptr)) {
+        mutex_hook_init();
+        if (real_mtx_unlock_func == nullptr) {
+            return thrd_error;
+        }
+    }
+    if (!g_cp || tls_inside_lock) {
+        return real_mtx_unlock_func(mtx);
+    }
+    int res = unlock_and_submit(mtx, real_mtx_unlock_func);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 自旋锁的竞争不阻塞，而是消耗 CPU，按照 CPU 周期统计
+__attribute__((noinline)) int pthread_spin_lock_impl(pthread_spinlock_t* lock) {
+    if (__glibc_unlikely(real_pthread_spin_lock_func == nullptr)) {
+        mutex_hook_init();
+    }
+    if (!g_cp || tls_inside_lock) {
+        return real_pthread_spin_lock_func(lock);
+    }
+    int res = pthread_spin_trylock(lock);
+    if (res != EBUSY) {
+        if (res == 0) {
+            on_uncontended_lock(const_cast<int*>(lock));
+        }
+        return res;
+    }
+    // pthread_spinlock_t 是 volatile int，转换一下作为 key
+    res = contended_lock(const_cast<int*>(lock), [](int* l) {
+        return real_pthread_spin_lock_func(l);
+    }, SAMPLE_KIND_SPIN, false);
+    prevent_tail_call(res);
+    return res;
+}
+
+__attribute__((noinline)) int pthread_spin_unlock_impl(pthread_spinlock_t* lock) {
+    if (__glibc_unlikely(real_pthread_spin_unlock_func == nullptr)) {
+        mutex_hook_init();
+    }
+    if (!g_cp || tls_inside_lock) {
+        return real_pthread_spin_unlock_func(lock);
+    }
+    int res = unlock_and_submit(const_cast<int*>(lock), [](int* l) {
+        return real_pthread_spin_unlock_func(l);
+    });
+    prevent_tail_call(res);
+    return res;
+}
+
+// 读写锁当前是否被写者持有，glibc 在 __cur_writer 中记录写锁持有者的 tid
+// 这里只是竞争发生时的一次快照，不需要与加锁操作同步
+inline bool is_rwlock_held_by_writer(pthread_rwlock_t* rwlock) {
+    return __atomic_load_n(&rwlock->__data.__cur_writer, __ATOMIC_RELAXED) != 0;
+}
+
+__attribute__((noinline)) int pthread_rwlock_rdlock_impl(pthread_rwlock_t* rwlock) {
+    if (__glibc_unlikely(real_pthread_rwlock_rdlock_func == nullptr)) {
+        mutex_hook_init();
+    }
+    if (!g_cp || tls_inside_lock) {
+        return real_pthread_rwlock_rdlock_func(rwlock);
+    }
+    int res = real_pthread_rwlock_tryrdlock_func(rwlock);
+    if (res != EBUSY) {
+        if (res == 0) {
+            on_uncontended_lock(rwlock);
+        }
+        return res;
+    }
+    // 读者被阻塞，要么有写者持有锁，要么有写者在排队（写优先）
+    const int kind = is_rwlock_held_by_writer(rwlock)
+        ? SAMPLE_KIND_RWLOCK_RD_BLOCKED_BY_WR : SAMPLE_KIND_RWLOCK_RD_BLOCKED_BY_WAITING_WR;
+    res = contended_lock(rwlock, real_pthread_rwlock_rdlock_func, kind, true);
+    prevent_tail_call(res);
+    return res;
+}
+
+__attribute__((noinline)) int pthread_rwlock_wrlock_impl(pthread_rwlock_t* rwlock) {
+    if (__glibc_unlikely(real_pthread_rwlock_wrlock_func == nullptr)) {
+        mutex_hook_init();
+    }
+    if (!g_cp || tls_inside_lock) {
+        return real_pthread_rwlock_wrlock_func(rwlock);
+    }
+    int res = real_pthread_rwlock_trywrlock_func(rwlock);
+    if (res != EBUSY) {
+        if (res == 0) {
+            on_uncontended_lock(rwlock);
+        }
+        return res;
+    }
+    const int kind = is_rwlock_held_by_writer(rwlock)
+        ? SAMPLE_KIND_RWLOCK_WR_BLOCKED_BY_WR : SAMPLE_KIND_RWLOCK_WR_BLOCKED_BY_RD;
+    res = contended_lock(rwlock, real_pthread_rwlock_wrlock_func, kind, false);
+    prevent_tail_call(res);
+    return res;
+}
+
+// trylock 不会阻塞，也就不存在等待，直接放行
+__attribute__((noinline)) int pthread_rwlock_tryrdlock_impl(pthread_rwlock_t* rwlock) {
+    if (__glibc_unlikely(real_pthread_rwlock_tryrdlock_func == nullptr)) {
+        mutex_hook_init();
+    }
+    return real_pthread_rwlock_tryrdlock_func(rwlock);
+}
+
+__attribute__((noinline)) int pthread_rwlock_trywrlock_impl(pthread_rwlock_t* rwlock) {
+    if (__glibc_unlikely(real_pthread_rwlock_trywrlock_func == nullptr)) {
+        mutex_hook_init();
+    }
+    return real_pthread_rwlock_trywrlock_func(rwlock);
+}
+
+__attribute__((noinline)) int pthread_rwlock_unlock_impl(pthread_rwlock_t* rwlock) {
+    if (__glibc_unlikely(real_pthread_rwlock_unlock_func == nullptr)) {
+        mutex_hook_init();
+    }
+    if (!g_cp || tls_inside_lock) {
+        return real_pthread_rwlock_unlock_func(rwlock);
+    }
+    int res = unlock_and_submit(rwlock, real_pthread_rwlock_unlock_func);
+    prevent_tail_call(res);
+    return res;
+}
+
+/**
+ * @brief 记录一次被采样的条件变量等待
+ * split_time_ns 之前是等待信号，之后是重新获取 mutex
+ * 同一个线程在解锁前多次等待（while 循环等待条件成立），视作一次等待，时间累加
+ */
+static void add_cond_wait_site(pthread_mutex_t* mutex, size_t sampling_range,
+    uint64_t start_time_ns, uint64_t split_time_ns, uint64_t end_time_ns) {
+    TLSCondWaitSite& site = tls_cond_site;
+    if (site.mutex != mutex || site.cp_version != g_cp_version) {
+        site.mutex = mutex;
+        site.cp_version = g_cp_version;
+        site.signal_csite = {0, sampling_range, SAMPLE_KIND_COND_WAIT_SIGNAL};
+        site.reacquire_csite = {0, sampling_range, SAMPLE_KIND_COND_REACQUIRE};
+    }
+    site.signal_csite.duration_ns += split_time_ns - start_time_ns;
+    site.reacquire_csite.duration_ns += end_time_ns - split_time_ns;
+}
+
+// 是否需要对这次条件变量等待计时
+// 已经有一次同一个 mutex 上被采样的等待未提交，说明是它的延续，一定计时
+// 已经有一次其它 mutex 上的等待未提交（嵌套），为了不覆盖它，这次不采样
+static size_t is_cond_wait_collectable(pthread_mutex_t* mutex) {
+    const TLSCondWaitSite& site = tls_cond_site;
+    if (site.mutex != nullptr && site.cp_version == g_cp_version) {
+        return site.mutex == mutex ? site.signal_csite.sampling_range : 0;
+    }
+    return is_collectable(&g_cp_sl, mutex);
+}
+
+// 等待之前：检查上一次唤醒是否无效，并登记为等待者
+// 无效唤醒的调用栈使用唤醒它的那一次 signal/broadcast 的调用栈（wakeup_generation 相同），
+// 时间为被唤醒到再次等待的时间，沿用被唤醒的那次等待的采样结果
+// 这里仍持有 mutex，只有被采样时才有一次提交的开销，不需要采集调用栈
+// 被采样的等待登记到 sampled_waiters，唤醒方看到后保存自己的调用栈
+static CondMapEntry* before_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex, size_t sampling_range) {
+    CondMapEntry* entry = get_cond_map_entry(cond);
+    TLSCondWakeup& wakeup = tls_cond_wakeup;
+    if (entry != nullptr && wakeup.cond == cond && wakeup.mutex == mutex
+        && wakeup.cp_version == g_cp_version && wakeup.sampling_range) {
+        const uint64_t now_ns = Util::get_monotonic_time_ns();
+        pthread_contention_site_t csite = {static_cast<int64_t>(now_ns - wakeup.wakeup_time_ns),
+            wakeup.sampling_range, SAMPLE_KIND_COND_WASTED_WAKEUP};
+        submit_contention_with_stack(csite, now_ns, entry->wakeup_stack.load_tagged(wakeup.wakeup_generation));
+    }
+    wakeup.cond = nullptr;
+    wakeup.mutex = nullptr;
+    if (entry != nullptr) {
+        entry->waiters.fetch_add(1, std::memory_order_relaxed);
+        if (sampling_range) {
+            entry->sampled_waiters.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    return entry;
+}
+
+// 等待结束，撤销 before_cond_wait 中的登记
+static void end_cond_wait(CondMapEntry* entry, size_t sampling_range) {
+    if (entry == nullptr) {
+        return;
+    }
+    entry->waiters.fetch_sub(1, std::memory_order_relaxed);
+    if (sampling_range) {
+        entry->sampled_waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief 等待结束之后（已重新持有 mutex）的处理
+ * 以 cond 最近一次被 signal/broadcast 的时间为分界点，之前是等待信号，之后是重新获取 mutex
+ * 超时、虚假唤醒或者分界点无效时，全部时间都算作等待信号
+ *
+ * @param woken 是否被唤醒，超时返回时为 false
+ */
+static void after_cond_wait(CondMapEntry* entry, pthread_cond_t* cond, pthread_mutex_t* mutex,
+    size_t sampling_range, uint64_t start_time_ns, bool woken) {
+    const uint64_t end_time_ns = Util::get_monotonic_time_ns();
+    uint64_t split_time_ns = end_time_ns;
+    uint32_t wakeup_generation = 0;
+    if (entry != nullptr) {
+        // 在撤销登记之前读取，唤醒方看到这次等待被采样，一定以这个 generation 保存了调用栈
+        wakeup_generation = entry->wakeup_generation.load(std::memory_order_acquire);
+        end_cond_wait(entry, sampling_range);
+        const uint64_t signal_time_ns = entry->signal_time_ns.load(std::memory_order_relaxed);
+        if (signal_time_ns >= start_time_ns && signal_time_ns <= end_time_ns) {
+            split_time_ns = signal_time_ns;
+        }
+    }
+    if (woken) {
+        tls_cond_wakeup = {cond, mutex, g_cp_version, split_time_ns, sampling_range, wakeup_generation};
+    }
+    if (sampling_range) {
+        add_cond_wait_site(mutex, sampling_range, start_time_ns, split_time_ns, end_time_ns);
+    }
+}
+
+__attribute__((noinline)) int pthread_cond_wait_impl(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+    if (__glibc_unlikely(real_pthread_cond_wait_func == nullptr)) {
+        mutex_hook_init();
+    }
+    if (!g_cp || tls_inside_lock) {
+        return real_pthread_cond_wait_func(cond, mutex);
+    }
+    const size_t sampling_range = is_cond_wait_collectable(mutex);
+    CondMapEntry* entry = before_cond_wait(cond, mutex, sampling_range);
+    const uint64_t start_time_ns = Util::get_monotonic_time_ns();
+    MutexAndContentionSite* hold_site = find_tls_hold_site(mutex);
+    if (hold_site != nullptr) {
+        hold_site->hold_csite.duration_ns += start_time_ns - hold_site->hold_start_ns;
+    }
+    int res = real_pthread_cond_wait_func(cond, mutex);
+    if (hold_site != nullptr) {
+        hold_site->hold_start_ns = Util::get_monotonic_time_ns();
+    }
+    if (res == 0) {
+        after_cond_wait(entry, cond, mutex, sampling_range, start_time_ns, true);
+    } else {
+        end_cond_wait(entry, sampling_range);
+    }
+    return res;
+}
+
+__attribute__((noinline)) int pthread_cond_timedwait_impl(pthread_cond_t* cond, pthread_mutex_t* mutex,
+    const struct timespec* abstime) {
+    if (__glibc_unlikely(real_pthread_cond_timedwait_func == nullptr)) {
+        mutex_hook_init();
+    }
+    if (!g_cp || tls_inside_lock) {
+        return real_pthread_cond_timedwait_func(cond, mutex, abstime);
+    }
+    const size_t sampling_range = is_cond_wait_collectable(mutex);
+    CondMapEntry* entry = before_cond_wait(cond, mutex, sampling_range);
+    const uint64_t start_time_ns = Util::get_monotonic_time_ns();
+    MutexAndContentionSite* hold_site = find_tls_hold_site(mutex);
+    if (hold_site != nullptr) {
+        hold_site->hold_csite.duration_ns += start_time_ns - hold_site->hold_start_ns;
+    }
+    int res = real_pthread_cond_timedwait_func(cond, mutex, abstime);
+    if (hold_site != nullptr) {
+        hold_site->hold_start_ns = Util::get_monotonic_time_ns();
+    }
+    // 超时返回时同样重新持有了 mutex
+    if (res == 0 || res == ETIMEDOUT) {
+        after_cond_wait(entry, cond, mutex, sampling_range, start_time_ns, res == 0);
+    } else {
+        end_cond_wait(entry, sampling_range);
+    }
+    return res;
+}
+
+/**
+ * @brief 唤醒等待者，并记录唤醒时间，等待方据此拆分等待信号和重新获取 mutex 的时间
+ * 被采样时提交这次唤醒的等待者数量；被采样或者有被采样的等待者时，以这次的 wakeup_generation 保存调用栈，
+ * 被它唤醒的等待者的无效唤醒归因到这个调用栈。没有等待者时什么都不采集，调用者通常持有 mutex
+ * 在真正唤醒之前保存，被唤醒的等待者读取时一定已经保存好
+ * 不能内联，调用栈中要固定占一层，参考 SKIPPED_STACK_FRAMES
+ *
+ * @param broadcast 为 true 时唤醒全部等待者，否则最多唤醒一个
+ */
+__attribute__((noinline)) static int wakeup_and_submit(pthread_cond_t* cond,
+    pthread_cond_signal_func_type real_func, bool broadcast) {
+    CondMapEntry* entry = get_cond_map_entry(cond);
+    if (entry == nullptr) {
+        return real_func(cond);
+    }
+    const uint64_t signal_time_ns = Util::get_monotonic_time_ns();
+    entry->signal_time_ns.store(signal_time_ns, std::memory_order_relaxed);
+    const uint32_t generation = entry->wakeup_generation.fetch_add(1, std::memory_order_acq_rel) + 1;
+    const int waiters = entry->waiters.load(std::memory_order_relaxed);
+    if (waiters <= 0) {
+        return real_func(cond);
+    }
+    const size_t sampling_range = is_collectable(&g_cp_sl, cond);
+    if (sampling_range) {
+        pthread_contention_site_t csite = {0, sampling_range, SAMPLE_KIND_COND_WAKEUP};
+        submit_contention(csite, signal_time_ns, broadcast ? waiters : 1, &entry->wakeup_stack, generation);
+    } else if (entry->sampled_waiters.load(std::memory_order_relaxed) > 0) {
+        save_current_stack(&entry->wakeup_stack, generation);
+    }
+    return real_func(cond);
+}
+
+__attribute__((noinline)) int pthread_cond_signal_impl(pthread_cond_t* cond) {
+    if (__glibc_unlikely(real_pthread_cond_signal_func == nullptr)) {
+        mutex_hook_init();
+    }
+    if (!g_cp || tls_inside_lock) {
+        return real_pthread_cond_signal_func(cond);
+    }
+    int res = wakeup_and_submit(cond, real_pthread_cond_signal_func, false);
+    prevent_tail_call(res);
+    return res;
+}
+
+__attribute__((noinline)) int pthread_cond_broadcast_impl(pthread_cond_t* cond) {
+    if (__glibc_unlikely(real_pthread_cond_broadcast_func == nullptr)) {
+        mutex_hook_init();
+    }
+    if (!g_cp || tls_inside_lock) {
+        return real_pthread_cond_broadcast_func(cond);
+    }
+    int res = wakeup_and_submit(cond, real_pthread_cond_broadcast_func, true);
+    prevent_tail_call(res);
+    return res;
+}
+
+/**
+ * @brief 信号量等待，信号量不会被“持有”，等待结束后立即提交
+ * 不能内联，调用栈中要固定占一层，参考 SKIPPED_STACK_FRAMES
+ *
+ * @param real_wait_func 真正的等待函数，参数为 sem，失败时返回 -1 并设置 errno
+ */
+template <typename F>
+__attribute__((noinline)) static int sem_wait_and_submit(sem_t* sem, F real_wait_func) {
+    const size_t sampling_range = is_collectable(&g_cp_sl, sem);
+    if (!sampling_range) {
+        return real_wait_func(sem);
+    }
+    const uint64_t start_time_ns = Util::get_monotonic_time_ns();
+    int res = real_wait_func(sem);
+    const int saved_errno = errno;
+    if (res == 0 || saved_errno == ETIMEDOUT) {
+        const uint64_t now_ns = Util::get_monotonic_time_ns();
+        pthread_contention_site_t csite = {static_cast<int64_t>(now_ns - start_time_ns), sampling_range,
+            res == 0 ? SAMPLE_KIND_SEM_WAIT : SAMPLE_KIND_SEM_TIMEDOUT};
+        submit_contention(csite, now_ns);
+    }
+    errno = saved_errno;
+    return res;
+}
+
+__attribute__((noinline)) int sem_wait_impl(sem_t* sem) {
+    if (__glibc_unlikely(real_sem_wait_func == nullptr)) {
+        mutex_hook_init();
+    }
+    if (!g_cp || tls_inside_lock) {
+        return real_sem_wait_func(sem);
+    }
+    // 信号量大于 0 时不需要等待，直接放行
+    if (sem_trywait(sem) == 0) {
+        return 0;
+    }
+    int res = sem_wait_and_submit(sem, real_sem_wait_func);
+    prevent_tail_call(res);
+    return res;
+}
+
+__attribute__((noinline)) int sem_timedwait_impl(sem_t* sem, const struct timespec* abstime) {
+    if (__glibc_unlikely(real_sem_timedwait_func == nullptr)) {
+        mutex_hook_init();
+    }
+    if (!g_cp || tls_inside_lock) {
+        return real_sem_timedwait_func(sem, abstime);
+    }
+    if (sem_trywait(sem) == 0) {
+        return 0;
+    }
+    int res = sem_wait_and_submit(sem, [abstime](sem_t* s) {
+        return real_sem_timedwait_func(s, abstime);
+    });
+    prevent_tail_call(res);
+    return res;
+}
+
+const size_t BARRIER_MAP_SIZE = 256;
+struct BarrierMapEntry {
+    std::atomic<pthread_barrier_t*> barrier;
+    // 正在等待的被采样的线程数，为 0 时最后到达的线程不需要采集调用栈
+    std::atomic<int> sampled_waiters;
+    // 最近一次保存的最后到达的线程的调用栈，tag 为它所在的轮次，所有等待者的时间都归因到它
+    StackSlot last_arrival_stack;
+    // 到达过的线程总数，除以 count 就是到达的线程所在的轮次
+    std::atomic<uint64_t> arrivals;
+    // pthread_barrier_init 的 count
+    unsigned int count;
+};
+// 在 pthread_barrier_init 时占用表项，destroy 时释放
+// 与 profile 无关，不使用 g_cp_version；表项冲突的屏障不采样
+static BarrierMapEntry g_barrier_map[BARRIER_MAP_SIZE] = {};
+
+inline BarrierMapEntry& get_barrier_map_slot(const pthread_barrier_t* barrier) {
+    return g_barrier_map[hash_mutex_ptr(barrier) & (BARRIER_MAP_SIZE - 1)];
+}
+
+static BarrierMapEntry* get_barrier_map_entry(const pthread_barrier_t* barrier) {
+    BarrierMapEntry& entry = get_barrier_map_slot(barrier);
+    return entry.barrier.load(std::memory_order_acquire) == barrier ? &entry : nullptr;
+}
+
+/**
+ * @brief 屏障等待，等待时间反映的是线程间的负载不均衡，归因到最后到达的线程的调用栈
+ * 最后到达的线程由真正的屏障决定：glibc 把 PTHREAD_BARRIER_SERIAL_THREAD 返回给最后到达的线程，
+ * 它返回后如果有被采样的等待者，以自己的轮次为 tag 保存调用栈；等待者被唤醒后只读取自己这一轮的调用栈，
+ * 还没有保存时不等待，提交不带调用栈的采样（等待时间仍然计入总量）
+ * 轮次由到达时的 arrivals 计数得到，这一轮的线程都到达之前，下一轮的线程不会被放行，因此计数与真正的屏障一致
+ * 被采样的等待者在进入真正的等待之前登记，最后到达的线程一定能看到
+ * 不能内联，调用栈中要固定占一层，参考 SKIPPED_STACK_FRAMES
+ *
+ * @param round 当前线程所在的轮次
+ */
+__attribute__((noinline)) static int barrier_wait_and_submit(pthread_barrier_t* barrier, BarrierMapEntry* entry,
+    uint32_t round) {
+    const size_t sampling_range = is_collectable(&g_cp_sl, barrier);
+    if (sampling_range) {
+        entry->sampled_waiters.fetch_add(1, std::memory_order_relaxed);
+    }
+    const uint64_t start_time_ns = Util::get_monotonic_time_ns();
+    int res = real_pthread_barrier_wait_func(barrier);
+    if (res == PTHREAD_BARRIER_SERIAL_THREAD) {
+        // 最后到达的线程自己几乎没有等待，不提交
+        if (sampling_range) {
+            entry->sampled_waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+        if (entry->sampled_waiters.load(std::memory_order_relaxed) > 0) {
+            save_current_stack(&entry->last_arrival_stack, round);
+        }
+        return res;
+    }
+    if (!sampling_range) {
+        return res;
+    }
+    const uint64_t now_ns = Util::get_monotonic_time_ns();
+    // 读取调用栈之后才撤销登记，最后到达的线程检查时一定还能看到
+    const uint32_t stack_id = res == 0 ? entry->last_arrival_stack.load_tagged(round) : INVALID_STACK_ID;
+    entry->sampled_waiters.fetch_sub(1, std::memory_order_relaxed);
+    pthread_contention_site_t csite = {
+        static_cast<int64_t>(now_ns - start_time_ns), sampling_range, SAMPLE_KIND_BARRIER_WAIT};
+    tls_inside_lock = true;
+    submit_sample(csite, 1, stack_id, false, now_ns);
+    tls_inside_lock = false;
+    return res;
+}
+
+__attribute__((noinline)) int pthread_barrier_init_impl(pthread_barrier_t* barrier, const pthread_barrierattr_t* attr,
+    unsigned int count) {
+    if (__glibc_unlikely(real_pthread_barrier_init_func == nullptr)) {
+        mutex_hook_init();
+    }
+    int res = real_pthread_barrier_init_func(barrier, attr, count);
+    if (res != 0) {
+        return res;
+    }
+    BarrierMapEntry& entry = get_barrier_map_slot(barrier);
+    pthread_barrier_t* expected = nullptr;
+    if (entry.barrier.load(std::memory_order_relaxed) == barrier
+        || entry.barrier.compare_exchange_strong(expected, barrier, std::memory_order_relaxed)) {
+        entry.sampled_waiters.store(0, std::memory_order_relaxed);
+        entry.last_arrival_stack.store_tagged(INVALID_STACK_ID, 0);
+        entry.arrivals.store(0, std::memory_order_relaxed);
+        entry.count = count;
+        // 发布重置后的字段
+        entry.barrier.store(barrier, std::memory_order_release);
+    }
+    return res;
+}
+
+__attribute__((noinline)) int pthread_barrier_destroy_impl(pthread_barrier_t* barrier) {
+    if (__glibc_unlikely(real_pthread_barrier_destroy_func == nullptr)) {
+        mutex_hook_init();
+    }
+    int res = real_pthread_barrier_destroy_func(barrier);
+    if (res == 0) {
+        pthread_barrier_t* expected = barrier;
+        get_barrier_map_slot(barrier).barrier.compare_exchange_strong(expected, nullptr, std::memory_order_relaxed);
+    }
+    return res;
+}
+
+__attribute__((noinline)) int pthread_barrier_wait_impl(pthread_barrier_t* barrier) {
+    if (__glibc_unlikely(real_pthread_barrier_wait_func == nullptr)) {
+        mutex_hook_init();
+    }
+    BarrierMapEntry* entry = get_barrier_map_entry(barrier);
+    if (entry == nullptr) {
+        return real_pthread_barrier_wait_func(barrier);
+    }
+    // 不采样时也要计数，否则开始 profile 后算出的轮次会与真正的屏障错开
+    const uint64_t arrival = entry->arrivals.fetch_add(1, std::memory_order_relaxed);
+    if (!g_cp || tls_inside_lock) {
+        return real_pthread_barrier_wait_func(barrier);
+    }
+    int res = barrier_wait_and_submit(barrier, entry, static_cast<uint32_t>(arrival / entry->count));
+    prevent_tail_call(res);
+    return res;
+}
+
+void get_contention_profiler_stats(ContentionProfilerStats* stats) {
+    stats->mutex_map_collisions = g_mutex_map_collisions.load(std::memory_order_relaxed);
+    stats->mutex_map_drops = g_mutex_map_drops.load(std::memory_order_relaxed);
+    stats->mutex_map_capacity = 0;
+    for (int level = 0; level < MUTEX_MAP_MAX_TABLES
+        && g_mutex_map[level].entries.load(std::memory_order_relaxed) != nullptr; ++level) {
+        stats->mutex_map_capacity += get_mutex_map_capacity(level);
+    }
+    stats->tls_site_overflows = g_tls_site_overflows.load(std::memory_order_relaxed);
+    get_stack_table_stats(&stats->interned_stacks, &stats->interned_stack_bytes, &stats->stack_table_drops);
+    get_stack_memo_stats(&stats->stack_memo_hits, &stats->stack_memo_misses,
+        &stats->stack_memo_verifications, &stats->stack_memo_mismatches);
+    stats->shallow_stack_samples = g_shallow_stack_samples.load(std::memory_order_relaxed);
+    stats->sample_ring_overflows = get_collector_sample_ring_overflows();
+    stats->pre_aggregated_samples = g_pre_aggregated_samples.load(std::memory_order_relaxed);
+    for (int i = 0; i < SAMPLING_STRATA_COUNT; ++i) {
+        const CollectorSpeedLimitStratum& stratum = g_cp_sl.strata[i];
+        stats->sampling_ranges[i] = stratum.sampling_range.load(std::memory_order_relaxed);
+        stats->sampling_event_rates[i] = stratum.event_rate.load(std::memory_order_relaxed);
+    }
+    stats->deepened_stack_samples = g_deepened_stack_samples.load(std::memory_order_relaxed);
+    for (int i = 0; i < LOCK_DEPTH_HISTOGRAM_SIZE; ++i) {
+        stats->lock_depth_histogram[i] = g_lock_depth_histogram[i].load(std::memory_order_relaxed);
+    }
+}
+
+void ignore_current_thread() {
+    tls_inside_lock = true;
 }
 
 }  // namespace contention_prof
@@ -14,17 +14,54 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <threads.h>
 
 namespace contention_prof {
 
 typedef struct {
     int64_t duration_ns;
     size_t sampling_range;
+    // 采样类型，参考 SampleKind
+    int kind;
+    // 开始等待时持有者调用栈的 seq，等待者解锁时据此判断持有者是否保存过新的调用栈
+    // 只对 SAMPLE_KIND_MUTEX 和 SAMPLE_KIND_TIMEDLOCK_ACQUIRED 有效
+    uint32_t holder_stack_seq;
 } pthread_contention_site_t;
 
 void mutex_hook_init();
 
 int pthread_mutex_lock_impl(pthread_mutex_t* mutex);
 int pthread_mutex_unlock_impl(pthread_mutex_t* mutex);
+int pthread_mutex_timedlock_impl(pthread_mutex_t* mutex, const struct timespec* abstime);
+int pthread_mutex_clocklock_impl(pthread_mutex_t* mutex, clockid_t clockid, const struct timespec* abstime);
+
+int pthread_spin_lock_impl(pthread_spinlock_t* lock);
+int pthread_spin_unlock_impl(pthread_spinlock_t* lock);
+
+int mtx_lock_impl(mtx_t* mtx);
+int mtx_timedlock_impl(mtx_t* mtx, const struct timespec* time_point);
+int mtx_unlock_impl(mtx_t* mtx);
+
+int pthread_rwlock_rdlock_impl(pthread_rwlock_t* rwlock);
+int pthread_rwlock_wrlock_impl(pthread_rwlock_t* rwlock);
+int pthread_rwlock_tryrdlock_impl(pthread_rwlock_t* rwlock);
+int pthread_rwlock_trywrlock_impl(pthread_rwlock_t* rwlock);
+int pthread_rwlock_unlock_impl(pthread_rwlock_t* rwlock);
+
+int pthread_cond_wait_impl(pthread_cond_t* cond, pthread_mutex_t* mutex);
+int pthread_cond_timedwait_impl(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* abstime);
+int pthread_cond_signal_impl(pthread_cond_t* cond);
+int pthread_cond_broadcast_impl(pthread_cond_t* cond);
+
+int sem_wait_impl(sem_t* sem);
+int sem_timedwait_impl(sem_t* sem, const struct timespec* abstime);
+
+int pthread_barrier_init_impl(pthread_barrier_t* barrier, const pthread_barrierattr_t* attr, unsigned int count);
+int pthread_barrier_destroy_impl(pthread_barrier_t* barrier);
+int pthread_barrier_wait_impl(pthread_barrier_t* barrier);
+
+// 当前线程的锁操作不再采样，用于 profiler 自己的后台线程
+void ignore_current_thread();
  
 }  // namespace contention_prof
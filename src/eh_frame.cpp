@@ -0,0 +1,938 @@
+#include <dlfcn.h>
+#include <link.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <vector>
+#include "common/thread_local.h"
+#include "collector.h"
+#include "stack_trace.h"
+#include "eh_frame.h"
+
+namespace contention_prof {
+
+typedef int (*dlclose_func_type)(void* handle);
+
+static dlclose_func_type get_real_dlclose() {
+    static std::atomic<dlclose_func_type> s_real_dlclose(nullptr);
+    dlclose_func_type real_dlclose = s_real_dlclose.load(std::memory_order_acquire);
+    if (real_dlclose == nullptr) {
+        real_dlclose = (dlclose_func_type)dlsym(RTLD_NEXT, "dlclose");
+        s_real_dlclose.store(real_dlclose, std::memory_order_release);
+    }
+    return real_dlclose;
+}
+
+#if defined(__x86_64__)
+
+// 一个模块可执行段的范围，以及 .eh_frame_hdr 中的二分查找表和 .eh_frame 的副本
+// 采集只读取副本，模块被 glibc 内部卸载（不经过 dlclose）时也不会读到已经 unmap 的内存
+struct EhFrameModule {
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t eh_frame_hdr;
+    // (initial_location, fde) 对，都是相对 eh_frame_hdr 的偏移，按 initial_location 排序
+    std::vector<int32_t> table;
+    // .eh_frame 在模块中的地址，副本中的偏移与它相同
+    uintptr_t eh_frame;
+    // .eh_frame 的副本，末尾有 EH_FRAME_PADDING 个 0，解析时读取定长字段或者 LEB128 不会越界
+    std::vector<uint8_t> eh_frame_data;
+
+    const uint8_t* eh_frame_begin() const {
+        return eh_frame_data.data();
+    }
+
+    const uint8_t* eh_frame_end() const {
+        return eh_frame_data.data() + eh_frame_data.size() - EH_FRAME_PADDING;
+    }
+
+    // 副本中的地址加上它得到模块中的地址，用于 pcrel 编码的指针
+    intptr_t eh_frame_bias() const {
+        return static_cast<intptr_t>(eh_frame - reinterpret_cast<uintptr_t>(eh_frame_begin()));
+    }
+
+    static const size_t EH_FRAME_PADDING = 16;
+};
+
+// 模块的快照，生成后不再修改，按 start 排序
+struct EhFrameModules {
+    std::vector<EhFrameModule> modules;
+    unsigned long long adds;
+    unsigned long long subs;
+};
+
+static std::atomic<EhFrameModules*> g_eh_frame_modules(nullptr);
+// 串行化快照的更新，更新很少发生，这里不使用 pthread 的锁，避免被自己拦截
+static std::atomic<bool> g_eh_frame_refreshing(false);
+// profiler 启动时生成快照后置为 true，停止时置为 false，期间 grab_thread 维护快照
+static std::atomic<bool> g_eh_frame_enabled(false);
+
+// 每个采集线程一个，hazard 是它正在使用的快照，替换快照后要等没有线程使用旧的快照才能释放
+// 各个线程只写自己的缓存行，不同线程的采集之间没有共享的写
+struct EhFrameReader {
+    std::atomic<const EhFrameModules*> hazard;
+    std::atomic<bool> in_use;
+    EhFrameReader* next;
+    char padding[64 - sizeof(std::atomic<const EhFrameModules*>) - sizeof(std::atomic<bool>) - sizeof(void*)];
+};
+
+// 所有线程的 EhFrameReader，线程退出后留给之后的线程使用，不会释放
+static std::atomic<EhFrameReader*> g_eh_frame_readers(nullptr);
+static __thread EhFrameReader* tls_eh_frame_reader = nullptr;
+
+static void release_eh_frame_reader() {
+    tls_eh_frame_reader->in_use.store(false, std::memory_order_release);
+    tls_eh_frame_reader = nullptr;
+}
+
+static EhFrameReader* get_eh_frame_reader() {
+    if (tls_eh_frame_reader != nullptr) {
+        return tls_eh_frame_reader;
+    }
+    EhFrameReader* reader = nullptr;
+    for (EhFrameReader* r = g_eh_frame_readers.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        bool expected = false;
+        if (!r->in_use.load(std::memory_order_relaxed)
+            && r->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            reader = r;
+            break;
+        }
+    }
+    if (reader == nullptr) {
+        reader = new (std::nothrow) EhFrameReader;
+        if (reader == nullptr) {
+            return nullptr;
+        }
+        reader->hazard.store(nullptr, std::memory_order_relaxed);
+        reader->in_use.store(true, std::memory_order_relaxed);
+        reader->next = g_eh_frame_readers.load(std::memory_order_relaxed);
+        while (!g_eh_frame_readers.compare_exchange_weak(reader->next, reader, std::memory_order_release)) {
+        }
+    }
+    thread_atexit(release_eh_frame_reader);
+    tls_eh_frame_reader = reader;
+    return reader;
+}
+
+// 取得当前的快照并登记到 reader->hazard，用完后调用 release_modules
+// 登记后再确认快照没有被替换，与 replace_modules 都是 seq_cst，替换者一定能看到登记
+static const EhFrameModules* acquire_modules(EhFrameReader* reader) {
+    const EhFrameModules* snapshot = g_eh_frame_modules.load();
+    while (snapshot != nullptr) {
+        reader->hazard.store(snapshot);
+        const EhFrameModules* current = g_eh_frame_modules.load();
+        if (current == snapshot) {
+            break;
+        }
+        snapshot = current;
+    }
+    return snapshot;
+}
+
+static void release_modules(EhFrameReader* reader) {
+    reader->hazard.store(nullptr, std::memory_order_release);
+}
+
+// DWARF 中的指针编码
+const uint8_t DW_EH_PE_omit = 0xff;
+const uint8_t DW_EH_PE_absptr = 0x00;
+const uint8_t DW_EH_PE_uleb128 = 0x01;
+const uint8_t DW_EH_PE_udata2 = 0x02;
+const uint8_t DW_EH_PE_udata4 = 0x03;
+const uint8_t DW_EH_PE_udata8 = 0x04;
+const uint8_t DW_EH_PE_sleb128 = 0x09;
+const uint8_t DW_EH_PE_sdata2 = 0x0a;
+const uint8_t DW_EH_PE_sdata4 = 0x0b;
+const uint8_t DW_EH_PE_sdata8 = 0x0c;
+const uint8_t DW_EH_PE_pcrel = 0x10;
+const uint8_t DW_EH_PE_datarel = 0x30;
+const uint8_t DW_EH_PE_indirect = 0x80;
+
+// x86_64 上 DWARF 的寄存器编号
+const uint64_t DWARF_REG_RBP = 6;
+const uint64_t DWARF_REG_RSP = 7;
+const uint64_t DWARF_REG_RA = 16;
+
+template <typename T>
+inline T read_value(const uint8_t*& p) {
+    T value;
+    memcpy(&value, p, sizeof(T));
+    p += sizeof(T);
+    return value;
+}
+
+inline uint64_t read_uleb128(const uint8_t*& p) {
+    uint64_t value = 0;
+    int shift = 0;
+    uint8_t byte = 0;
+    do {
+        byte = *p++;
+        if (shift < 64) {
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        }
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+inline int64_t read_sleb128(const uint8_t*& p) {
+    uint64_t value = 0;
+    int shift = 0;
+    uint8_t byte = 0;
+    do {
+        byte = *p++;
+        if (shift < 64) {
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        }
+        shift += 7;
+    } while (byte & 0x80);
+    if (shift < 64 && (byte & 0x40)) {
+        value |= ~static_cast<uint64_t>(0) << shift;
+    }
+    return static_cast<int64_t>(value);
+}
+
+// 按 encoding 读取一个指针，只支持 pcrel 和 datarel 两种相对方式，不支持间接寻址
+// p 在 .eh_frame 的副本中时，bias 为 eh_frame_bias()，pcrel 相对的是字段在模块中的地址
+static bool read_encoded_pointer(const uint8_t*& p, uint8_t encoding, uintptr_t datarel_base, uintptr_t* out,
+    intptr_t bias = 0) {
+    if (encoding == DW_EH_PE_omit || (encoding & DW_EH_PE_indirect)) {
+        return false;
+    }
+    const uintptr_t field = reinterpret_cast<uintptr_t>(p) + bias;
+    uintptr_t value = 0;
+    switch (encoding & 0x0f) {
+    case DW_EH_PE_absptr:
+        value = read_value<uintptr_t>(p);
+        break;
+    case DW_EH_PE_uleb128:
+        value = read_uleb128(p);
+        break;
+    case DW_EH_PE_udata2:
+        value = read_value<uint16_t>(p);
+        break;
+    case DW_EH_PE_udata4:
+        value = read_value<uint32_t>(p);
+        break;
+    case DW_EH_PE_udata8:
+        value = read_value<uint64_t>(p);
+        break;
+    case DW_EH_PE_sleb128:
+        value = read_sleb128(p);
+        break;
+    case DW_EH_PE_sdata2:
+        value = read_value<int16_t>(p);
+        break;
+    case DW_EH_PE_sdata4:
+        value = read_value<int32_t>(p);
+        break;
+    case DW_EH_PE_sdata8:
+        value = read_value<int64_t>(p);
+        break;
+    default:
+        return false;
+    }
+    switch (encoding & 0x70) {
+    case 0:
+        break;
+    case DW_EH_PE_pcrel:
+        value += field;
+        break;
+    case DW_EH_PE_datarel:
+        value += datarel_base;
+        break;
+    default:
+        return false;
+    }
+    *out = value;
+    return true;
+}
+
+// addr 所在的 PT_LOAD 段的结束地址，不在任何段中时返回 0
+static uintptr_t get_segment_end(const struct dl_phdr_info* info, uintptr_t addr) {
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+        const uintptr_t begin = info->dlpi_addr + phdr.p_vaddr;
+        if (phdr.p_type == PT_LOAD && addr >= begin && addr < begin + phdr.p_memsz) {
+            return begin + phdr.p_memsz;
+        }
+    }
+    return 0;
+}
+
+// .eh_frame 中从 begin 开始连续的 CIE/FDE 的结束位置，遇到结束标记、不完整的项或者段的结尾时停止
+static uintptr_t get_eh_frame_end(uintptr_t begin, uintptr_t segment_end) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(begin);
+    const uint8_t* end = reinterpret_cast<const uint8_t*>(segment_end);
+    while (end - p >= static_cast<ptrdiff_t>(sizeof(uint32_t))) {
+        const uint8_t* entry = p;
+        uint64_t length = read_value<uint32_t>(p);
+        if (length == 0) {
+            return reinterpret_cast<uintptr_t>(entry);
+        }
+        if (length == 0xffffffff) {
+            if (end - p < static_cast<ptrdiff_t>(sizeof(uint64_t))) {
+                return reinterpret_cast<uintptr_t>(entry);
+            }
+            length = read_value<uint64_t>(p);
+        }
+        if (length > static_cast<uint64_t>(end - p)) {
+            return reinterpret_cast<uintptr_t>(entry);
+        }
+        p += length;
+    }
+    return reinterpret_cast<uintptr_t>(p);
+}
+
+// dl_iterate_phdr 的回调，收集每个有 .eh_frame_hdr 的模块
+// 回调期间模块不会被卸载，在这里复制查找表和 .eh_frame，只读取模块映射的段内的内存
+static int collect_module_callback(struct dl_phdr_info* info, size_t size, void* data) {
+    EhFrameModules* snapshot = static_cast<EhFrameModules*>(data);
+    if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+        snapshot->adds = info->dlpi_adds;
+        snapshot->subs = info->dlpi_subs;
+    }
+    EhFrameModule module;
+    module.start = UINTPTR_MAX;
+    module.end = 0;
+    module.eh_frame_hdr = 0;
+    module.eh_frame = 0;
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+        if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X)) {
+            module.start = std::min<uintptr_t>(module.start, info->dlpi_addr + phdr.p_vaddr);
+            module.end = std::max<uintptr_t>(module.end, info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz);
+        } else if (phdr.p_type == PT_GNU_EH_FRAME) {
+            module.eh_frame_hdr = info->dlpi_addr + phdr.p_vaddr;
+        }
+    }
+    if (module.eh_frame_hdr == 0 || module.start >= module.end) {
+        return 0;
+    }
+    const uintptr_t hdr_segment_end = get_segment_end(info, module.eh_frame_hdr);
+    if (hdr_segment_end < module.eh_frame_hdr + 4) {
+        return 0;
+    }
+    // .eh_frame_hdr: version, eh_frame_ptr_enc, fde_count_enc, table_enc, eh_frame_ptr, fde_count, table
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(module.eh_frame_hdr);
+    const uint8_t version = p[0];
+    const uint8_t eh_frame_ptr_enc = p[1];
+    const uint8_t fde_count_enc = p[2];
+    const uint8_t table_enc = p[3];
+    p += 4;
+    uintptr_t eh_frame_ptr = 0;
+    uintptr_t fde_count = 0;
+    // 链接器生成的查找表都是 datarel|sdata4，其他编码的不支持
+    if (version != 1 || table_enc != (DW_EH_PE_datarel | DW_EH_PE_sdata4)
+        || !read_encoded_pointer(p, eh_frame_ptr_enc, module.eh_frame_hdr, &eh_frame_ptr)
+        || !read_encoded_pointer(p, fde_count_enc, module.eh_frame_hdr, &fde_count) || fde_count == 0) {
+        return 0;
+    }
+    const int32_t* table = reinterpret_cast<const int32_t*>(p);
+    if (fde_count > (hdr_segment_end - reinterpret_cast<uintptr_t>(table)) / (2 * sizeof(int32_t))) {
+        return 0;
+    }
+    const uintptr_t eh_frame_segment_end = get_segment_end(info, eh_frame_ptr);
+    if (eh_frame_segment_end == 0) {
+        return 0;
+    }
+    const uintptr_t eh_frame_end = get_eh_frame_end(eh_frame_ptr, eh_frame_segment_end);
+    module.table.assign(table, table + fde_count * 2);
+    module.eh_frame = eh_frame_ptr;
+    module.eh_frame_data.assign(reinterpret_cast<const uint8_t*>(eh_frame_ptr),
+        reinterpret_cast<const uint8_t*>(eh_frame_end));
+    module.eh_frame_data.resize(module.eh_frame_data.size() + EhFrameModule::EH_FRAME_PADDING, 0);
+    snapshot->modules.push_back(std::move(module));
+    return 0;
+}
+
+// 只取第一个模块中的 dlpi_adds/dlpi_subs，所有模块中的值都相同
+static int read_counters_callback(struct dl_phdr_info* info, size_t size, void* data) {
+    unsigned long long* counters = static_cast<unsigned long long*>(data);
+    if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+        counters[0] = info->dlpi_adds;
+        counters[1] = info->dlpi_subs;
+    }
+    return 1;
+}
+
+static void lock_refresh() {
+    bool expected = false;
+    while (!g_eh_frame_refreshing.compare_exchange_weak(expected, true, std::memory_order_acquire)) {
+        expected = false;
+        sched_yield();
+    }
+}
+
+static void unlock_refresh() {
+    g_eh_frame_refreshing.store(false, std::memory_order_release);
+}
+
+// 替换快照，等待没有采集在使用旧的快照后再释放，调用者要持有 lock_refresh
+static void replace_modules(EhFrameModules* snapshot) {
+    EhFrameModules* old = g_eh_frame_modules.exchange(snapshot);
+    if (old == nullptr) {
+        return;
+    }
+    for (EhFrameReader* r = g_eh_frame_readers.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        while (r->hazard.load() == old) {
+            sched_yield();
+        }
+    }
+    delete old;
+}
+
+// 调用者要持有 lock_refresh
+static void rebuild_modules() {
+    EhFrameModules* snapshot = new EhFrameModules;
+    snapshot->adds = 0;
+    snapshot->subs = 0;
+    dl_iterate_phdr(collect_module_callback, snapshot);
+    std::sort(snapshot->modules.begin(), snapshot->modules.end(),
+        [](const EhFrameModule& a, const EhFrameModule& b) { return a.start < b.start; });
+    replace_modules(snapshot);
+}
+
+void refresh_eh_frame_modules() {
+    lock_refresh();
+    rebuild_modules();
+    g_eh_frame_enabled.store(true, std::memory_order_relaxed);
+    unlock_refresh();
+}
+
+void refresh_eh_frame_modules_if_changed() {
+    // profiler 没有运行时不用维护
+    if (!g_eh_frame_enabled.load(std::memory_order_relaxed)) {
+        return;
+    }
+    unsigned long long counters[2] = {0, 0};
+    dl_iterate_phdr(read_counters_callback, counters);
+    // 快照只在持有 lock_refresh 时被替换和释放，这里直接读取
+    lock_refresh();
+    const EhFrameModules* current = g_eh_frame_modules.load();
+    const bool changed = current == nullptr || current->adds != counters[0] || current->subs != counters[1];
+    // 可能已经被 disable_eh_frame_modules 停止
+    if (changed && g_eh_frame_enabled.load(std::memory_order_relaxed)) {
+        rebuild_modules();
+    }
+    unlock_refresh();
+}
+
+void invalidate_eh_frame_modules() {
+    if (g_eh_frame_modules.load() == nullptr) {
+        return;
+    }
+    lock_refresh();
+    replace_modules(nullptr);
+    unlock_refresh();
+}
+
+void disable_eh_frame_modules() {
+    lock_refresh();
+    g_eh_frame_enabled.store(false, std::memory_order_relaxed);
+    replace_modules(nullptr);
+    unlock_refresh();
+}
+
+// 查找 pc 所在的 FDE，返回它在副本中的位置，找不到时返回 nullptr
+static const uint8_t* find_fde(const EhFrameModules& snapshot, uintptr_t pc, const EhFrameModule** found) {
+    const std::vector<EhFrameModule>& modules = snapshot.modules;
+    auto it = std::upper_bound(modules.begin(), modules.end(), pc,
+        [](uintptr_t value, const EhFrameModule& module) { return value < module.start; });
+    if (it == modules.begin()) {
+        return nullptr;
+    }
+    const EhFrameModule& module = *(--it);
+    if (pc >= module.end) {
+        return nullptr;
+    }
+    const intptr_t rel = static_cast<intptr_t>(pc - module.eh_frame_hdr);
+    size_t low = 0;
+    size_t high = module.table.size() / 2;
+    // 找最后一个 initial_location <= pc 的表项
+    while (low < high) {
+        const size_t mid = low + (high - low) / 2;
+        if (module.table[mid * 2] <= rel) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0) {
+        return nullptr;
+    }
+    // 指向副本之外的表项（.eh_frame 被截断或者查找表有误）当作找不到
+    const uintptr_t fde = module.eh_frame_hdr + module.table[(low - 1) * 2 + 1];
+    if (fde < module.eh_frame
+        || fde - module.eh_frame >= static_cast<uintptr_t>(module.eh_frame_end() - module.eh_frame_begin())) {
+        return nullptr;
+    }
+    *found = &module;
+    return module.eh_frame_begin() + (fde - module.eh_frame);
+}
+
+// 寄存器的恢复规则，只跟踪 rbp 和返回地址
+enum RegRuleType {
+    RULE_SAME_VALUE = 0,
+    RULE_OFFSET,
+    RULE_UNDEFINED,
+    RULE_UNSUPPORTED,
+};
+
+struct RegRule {
+    int type;
+    int64_t offset;
+};
+
+struct UnwindRow {
+    uint64_t cfa_reg;
+    int64_t cfa_offset;
+    bool cfa_unsupported;
+    RegRule rbp;
+    RegRule ra;
+};
+
+struct CieInfo {
+    // 所在 .eh_frame 副本的 eh_frame_bias()
+    intptr_t bias;
+    uint64_t code_align;
+    int64_t data_align;
+    uint64_t ra_reg;
+    uint8_t fde_encoding;
+    bool has_augmentation_data;
+    const uint8_t* instructions;
+    const uint8_t* end;
+};
+
+// 读取 CIE/FDE 的长度，返回内容的起始位置，不支持 64 位格式和结束标记，超出 limit 的项也不支持
+static const uint8_t* read_entry_length(const uint8_t* p, const uint8_t* limit, const uint8_t** end) {
+    if (limit - p < static_cast<ptrdiff_t>(sizeof(uint32_t))) {
+        return nullptr;
+    }
+    const uint32_t length = read_value<uint32_t>(p);
+    if (length < sizeof(uint32_t) || length == 0xffffffff || length > static_cast<size_t>(limit - p)) {
+        return nullptr;
+    }
+    *end = p + length;
+    return p;
+}
+
+static bool parse_cie(const EhFrameModule& module, const uint8_t* cie, CieInfo* info) {
+    const uint8_t* p = read_entry_length(cie, module.eh_frame_end(), &info->end);
+    if (p == nullptr || read_value<uint32_t>(p) != 0) {
+        return false;
+    }
+    info->bias = module.eh_frame_bias();
+    const uint8_t version = *p++;
+    const char* augmentation = reinterpret_cast<const char*>(p);
+    const void* augmentation_end = p < info->end ? memchr(p, '\0', info->end - p) : nullptr;
+    if (augmentation_end == nullptr) {
+        return false;
+    }
+    p = static_cast<const uint8_t*>(augmentation_end) + 1;
+    // "eh" 是很老的 gcc 生成的，不支持
+    if (augmentation[0] != '\0' && augmentation[0] != 'z') {
+        return false;
+    }
+    if (version >= 4) {
+        // address_size, segment_selector_size
+        p += 2;
+    }
+    info->code_align = read_uleb128(p);
+    info->data_align = read_sleb128(p);
+    info->ra_reg = version == 1 ? *p++ : read_uleb128(p);
+    info->fde_encoding = DW_EH_PE_absptr;
+    info->has_augmentation_data = augmentation[0] == 'z';
+    if (info->has_augmentation_data) {
+        const uint64_t length = read_uleb128(p);
+        if (p > info->end || length > static_cast<uint64_t>(info->end - p)) {
+            return false;
+        }
+        const uint8_t* data_end = p + length;
+        for (const char* c = augmentation + 1; *c != '\0'; ++c) {
+            if (*c == 'R') {
+                info->fde_encoding = *p++;
+            } else if (*c == 'P') {
+                uintptr_t personality = 0;
+                const uint8_t encoding = *p++;
+                if (!read_encoded_pointer(p, encoding & ~DW_EH_PE_indirect, 0, &personality, info->bias)) {
+                    break;
+                }
+            } else if (*c == 'L') {
+                ++p;
+            } else if (*c == 'S') {
+                // 信号栈帧，返回地址不需要减一，这里遇到信号栈帧时停止
+                return false;
+            } else {
+                break;
+            }
+        }
+        p = data_end;
+    }
+    info->instructions = p;
+    return info->ra_reg == DWARF_REG_RA;
+}
+
+static void set_reg_rule(UnwindRow* row, uint64_t reg, int type, int64_t offset) {
+    RegRule rule = {type, offset};
+    if (reg == DWARF_REG_RBP) {
+        row->rbp = rule;
+    } else if (reg == DWARF_REG_RA) {
+        row->ra = rule;
+    }
+}
+
+// 执行 CFA 指令，直到位置超过 target，initial 为 CIE 中初始指令执行后的结果，用于 DW_CFA_restore
+static bool run_cfa_program(const uint8_t* p, const uint8_t* end, const CieInfo& cie,
+    uintptr_t location, uintptr_t target, const UnwindRow* initial, UnwindRow* row) {
+    const int MAX_REMEMBERED_STATES = 8;
+    UnwindRow remembered[MAX_REMEMBERED_STATES];
+    int remembered_count = 0;
+    while (p < end) {
+        const uint8_t op = *p++;
+        const uint8_t high = op & 0xc0;
+        const uint8_t low = op & 0x3f;
+        if (high == 0x40) {
+            // DW_CFA_advance_loc
+            location += low * cie.code_align;
+            if (location > target) {
+                return true;
+            }
+            continue;
+        }
+        if (high == 0x80) {
+            // DW_CFA_offset
+            set_reg_rule(row, low, RULE_OFFSET, static_cast<int64_t>(read_uleb128(p)) * cie.data_align);
+            continue;
+        }
+        if (high == 0xc0) {
+            // DW_CFA_restore
+            if (initial == nullptr) {
+                return false;
+            }
+            if (low == DWARF_REG_RBP) {
+                row->rbp = initial->rbp;
+            } else if (low == DWARF_REG_RA) {
+                row->ra = initial->ra;
+            }
+            continue;
+        }
+        switch (op) {
+        case 0x00:  // DW_CFA_nop
+            break;
+        case 0x01: {  // DW_CFA_set_loc
+            uintptr_t new_location = 0;
+            if (!read_encoded_pointer(p, cie.fde_encoding, 0, &new_location, cie.bias)) {
+                return false;
+            }
+            location = new_location;
+            if (location > target) {
+                return true;
+            }
+            break;
+        }
+        case 0x02:  // DW_CFA_advance_loc1
+            location += read_value<uint8_t>(p) * cie.code_align;
+            if (location > target) {
+                return true;
+            }
+            break;
+        case 0x03:  // DW_CFA_advance_loc2
+            location += read_value<uint16_t>(p) * cie.code_align;
+            if (location > target) {
+                return true;
+            }
+            break;
+        case 0x04:  // DW_CFA_advance_loc4
+            location += read_value<uint32_t>(p) * cie.code_align;
+            if (location > target) {
+                return true;
+            }
+            break;
+        case 0x05: {  // DW_CFA_offset_extended
+            const uint64_t reg = read_uleb128(p);
+            set_reg_rule(row, reg, RULE_OFFSET, static_cast<int64_t>(read_uleb128(p)) * cie.data_align);
+            break;
+        }
+        case 0x06: {  // DW_CFA_restore_extended
+            const uint64_t reg = read_uleb128(p);
+            if (initial == nullptr) {
+                return false;
+            }
+            if (reg == DWARF_REG_RBP) {
+                row->rbp = initial->rbp;
+            } else if (reg == DWARF_REG_RA) {
+                row->ra = initial->ra;
+            }
+            break;
+        }
+        case 0x07:  // DW_CFA_undefined
+            set_reg_rule(row, read_uleb128(p), RULE_UNDEFINED, 0);
+            break;
+        case 0x08:  // DW_CFA_same_value
+            set_reg_rule(row, read_uleb128(p), RULE_SAME_VALUE, 0);
+            break;
+        case 0x09: {  // DW_CFA_register
+            const uint64_t reg = read_uleb128(p);
+            read_uleb128(p);
+            set_reg_rule(row, reg, RULE_UNSUPPORTED, 0);
+            break;
+        }
+        case 0x0a:  // DW_CFA_remember_state
+            if (remembered_count >= MAX_REMEMBERED_STATES) {
+                return false;
+            }
+            remembered[remembered_count++] = *row;
+            break;
+        case 0x0b:  // DW_CFA_restore_state
+            if (remembered_count == 0) {
+                return false;
+            }
+            *row = remembered[--remembered_count];
+            break;
+        case 0x0c:  // DW_CFA_def_cfa
+            row->cfa_reg = read_uleb128(p);
+            row->cfa_offset = static_cast<int64_t>(read_uleb128(p));
+            row->cfa_unsupported = false;
+            break;
+        case 0x0d:  // DW_CFA_def_cfa_register
+            row->cfa_reg = read_uleb128(p);
+            row->cfa_unsupported = false;
+            break;
+        case 0x0e:  // DW_CFA_def_cfa_offset
+            row->cfa_offset = static_cast<int64_t>(read_uleb128(p));
+            break;
+        case 0x0f: {  // DW_CFA_def_cfa_expression
+            const uint64_t length = read_uleb128(p);
+            if (p > end || length > static_cast<uint64_t>(end - p)) {
+                return false;
+            }
+            p += length;
+            row->cfa_unsupported = true;
+            break;
+        }
+        case 0x10: {  // DW_CFA_expression
+            const uint64_t reg = read_uleb128(p);
+            const uint64_t length = read_uleb128(p);
+            if (p > end || length > static_cast<uint64_t>(end - p)) {
+                return false;
+            }
+            p += length;
+            set_reg_rule(row, reg, RULE_UNSUPPORTED, 0);
+            break;
+        }
+        case 0x11: {  // DW_CFA_offset_extended_sf
+            const uint64_t reg = read_uleb128(p);
+            set_reg_rule(row, reg, RULE_OFFSET, read_sleb128(p) * cie.data_align);
+            break;
+        }
+        case 0x12:  // DW_CFA_def_cfa_sf
+            row->cfa_reg = read_uleb128(p);
+            row->cfa_offset = read_sleb128(p) * cie.data_align;
+            row->cfa_unsupported = false;
+            break;
+        case 0x13:  // DW_CFA_def_cfa_offset_sf
+            row->cfa_offset = read_sleb128(p) * cie.data_align;
+            break;
+        case 0x14: {  // DW_CFA_val_offset
+            const uint64_t reg = read_uleb128(p);
+            read_uleb128(p);
+            set_reg_rule(row, reg, RULE_UNSUPPORTED, 0);
+            break;
+        }
+        case 0x15: {  // DW_CFA_val_offset_sf
+            const uint64_t reg = read_uleb128(p);
+            read_sleb128(p);
+            set_reg_rule(row, reg, RULE_UNSUPPORTED, 0);
+            break;
+        }
+        case 0x16: {  // DW_CFA_val_expression
+            const uint64_t reg = read_uleb128(p);
+            const uint64_t length = read_uleb128(p);
+            if (p > end || length > static_cast<uint64_t>(end - p)) {
+                return false;
+            }
+            p += length;
+            set_reg_rule(row, reg, RULE_UNSUPPORTED, 0);
+            break;
+        }
+        case 0x2e:  // DW_CFA_GNU_args_size
+            read_uleb128(p);
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+// 计算 pc 处的恢复规则
+static bool find_unwind_row(const EhFrameModules& snapshot, uintptr_t pc, UnwindRow* row) {
+    const EhFrameModule* module = nullptr;
+    const uint8_t* fde = find_fde(snapshot, pc, &module);
+    if (fde == nullptr) {
+        return false;
+    }
+    const uint8_t* fde_end = nullptr;
+    const uint8_t* p = read_entry_length(fde, module->eh_frame_end(), &fde_end);
+    if (p == nullptr) {
+        return false;
+    }
+    const uint8_t* cie_pointer_field = p;
+    const uint32_t cie_pointer = read_value<uint32_t>(p);
+    // CIE 指针是相对这个字段向前的偏移，不能指到副本之外
+    if (cie_pointer == 0 || cie_pointer > static_cast<size_t>(cie_pointer_field - module->eh_frame_begin())) {
+        return false;
+    }
+    CieInfo cie;
+    if (!parse_cie(*module, cie_pointer_field - cie_pointer, &cie)) {
+        return false;
+    }
+    uintptr_t pc_begin = 0;
+    uintptr_t pc_range = 0;
+    if (!read_encoded_pointer(p, cie.fde_encoding, 0, &pc_begin, cie.bias)
+        || !read_encoded_pointer(p, cie.fde_encoding & 0x0f, 0, &pc_range)) {
+        return false;
+    }
+    if (pc < pc_begin || pc >= pc_begin + pc_range) {
+        return false;
+    }
+    if (cie.has_augmentation_data) {
+        const uint64_t length = read_uleb128(p);
+        if (p > fde_end || length > static_cast<uint64_t>(fde_end - p)) {
+            return false;
+        }
+        p += length;
+    }
+    // x86_64 上函数入口处的默认规则：CFA = rsp + 8，返回地址在 CFA - 8
+    row->cfa_reg = DWARF_REG_RSP;
+    row->cfa_offset = 8;
+    row->cfa_unsupported = false;
+    row->rbp.type = RULE_SAME_VALUE;
+    row->rbp.offset = 0;
+    row->ra.type = RULE_UNDEFINED;
+    row->ra.offset = 0;
+    if (!run_cfa_program(cie.instructions, cie.end, cie, 0, UINTPTR_MAX, nullptr, row)) {
+        return false;
+    }
+    const UnwindRow initial = *row;
+    return run_cfa_program(p, fde_end, cie, pc_begin, pc, &initial, row);
+}
+
+struct UnwindRegs {
+    uintptr_t pc;
+    uintptr_t rsp;
+    uintptr_t rbp;
+};
+
+// 从 regs 所在的一帧恢复出调用者的寄存器，regs.pc 是返回地址，查找时要减一，落在 call 指令内
+static bool step_frame(const EhFrameModules& snapshot, const StackBounds& bounds, UnwindRegs* regs) {
+    UnwindRow row;
+    if (!find_unwind_row(snapshot, regs->pc - 1, &row) || row.cfa_unsupported) {
+        return false;
+    }
+    uintptr_t cfa = 0;
+    if (row.cfa_reg == DWARF_REG_RSP) {
+        cfa = regs->rsp + row.cfa_offset;
+    } else if (row.cfa_reg == DWARF_REG_RBP) {
+        cfa = regs->rbp + row.cfa_offset;
+    } else {
+        return false;
+    }
+    uintptr_t ra = 0;
+    if (row.ra.type != RULE_OFFSET || !read_stack_word(bounds, cfa + row.ra.offset, &ra)) {
+        return false;
+    }
+    uintptr_t rbp = regs->rbp;
+    if (row.rbp.type == RULE_OFFSET) {
+        if (!read_stack_word(bounds, cfa + row.rbp.offset, &rbp)) {
+            return false;
+        }
+    } else if (row.rbp.type == RULE_UNDEFINED) {
+        rbp = 0;
+    } else if (row.rbp.type != RULE_SAME_VALUE) {
+        return false;
+    }
+    // 栈必须向栈底方向增长
+    if (cfa <= regs->rsp) {
+        return false;
+    }
+    regs->pc = ra;
+    regs->rsp = cfa;
+    regs->rbp = rbp;
+    return true;
+}
+
+int eh_frame_stack_trace(void** frames, int max_frames, int skip) {
+    // 没有快照时不用登记
+    if (g_eh_frame_modules.load(std::memory_order_relaxed) == nullptr) {
+        return -1;
+    }
+    EhFrameReader* reader = get_eh_frame_reader();
+    if (reader == nullptr) {
+        return -1;
+    }
+    const EhFrameModules* snapshot = acquire_modules(reader);
+    if (snapshot == nullptr) {
+        release_modules(reader);
+        return -1;
+    }
+    // 本函数有帧指针（编译时 -fno-omit-frame-pointer），从本函数的帧记录得到调用者的寄存器
+    const StackBounds& bounds = get_current_stack_bounds();
+    const uintptr_t fp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+    UnwindRegs regs = {0, fp + 2 * sizeof(uintptr_t), 0};
+    int count = 0;
+    if (read_stack_word(bounds, fp, &regs.rbp) && read_stack_word(bounds, fp + sizeof(uintptr_t), &regs.pc)) {
+        while (count < max_frames && regs.pc != 0) {
+            if (skip > 0) {
+                --skip;
+            } else {
+                frames[count++] = reinterpret_cast<void*>(regs.pc);
+            }
+            if (!step_frame(*snapshot, bounds, &regs)) {
+                break;
+            }
+        }
+    }
+    release_modules(reader);
+    return count;
+}
+
+int dlclose_impl(void* handle) {
+    dlclose_func_type real_dlclose = get_real_dlclose();
+    // 模块可能在 dlclose 中被 unmap，地址之后可能被复用，先作废快照，
+    // 返回后唤醒 grab_thread 按新的模块列表重新生成，不在调用者的线程中遍历模块
+    if (!g_eh_frame_enabled.load(std::memory_order_relaxed)) {
+        return real_dlclose(handle);
+    }
+    invalidate_eh_frame_modules();
+    const int ret = real_dlclose(handle);
+    wakeup_collector();
+    return ret;
+}
+
+#else
+
+void refresh_eh_frame_modules() {}
+
+void refresh_eh_frame_modules_if_changed() {}
+
+void invalidate_eh_frame_modules() {}
+
+void disable_eh_frame_modules() {}
+
+int eh_frame_stack_trace(void** frames, int max_frames, int skip) {
+    return -1;
+}
+
+int dlclose_impl(void* handle) {
+    return get_real_dlclose()(handle);
+}
+
+#endif
+
+}  // namespace contention_prof
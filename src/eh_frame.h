@@ -0,0 +1,72 @@
+/**
+ * @file eh_frame.h
+ * @author noahyzhang
+ * @brief
+ * @version 0.1
+ * @date 2023-05-12
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+namespace contention_prof {
+
+/**
+ * 基于 .eh_frame_hdr 的调用栈采集，只支持 x86_64
+ * glibc 的 backtrace 每一帧都要通过 dl_iterate_phdr 查找所在的模块，需要获取加载器的锁，
+ * 在锁竞争严重时会成为新的竞争点，而且不能在持有加载器锁的线程（比如 dlopen 中）采集
+ * 这里在 profiler 启动时遍历一次所有模块，把每个模块可执行段的范围、.eh_frame_hdr 中的二分查找表
+ * 和 .eh_frame 复制为一个不可变的快照，采样路径中只读取快照和线程栈，不会调用 dl_iterate_phdr，
+ * 也不会读取模块的内存。glibc 内部卸载模块（比如 NSS、gconv，不经过 dlclose）时快照可能过期，
+ * 但不会读到已经 unmap 的内存，只会使这些地址的调用栈提前结束
+ * 快照的更新：
+ *   grab_thread 周期性地检查 dl_phdr_info 中的 dlpi_adds/dlpi_subs，有变化时重新生成
+ *   dlclose 在卸载模块前先作废快照，并等待正在使用快照的采集结束，避免地址被新模块复用后用错 CFI，
+ *   卸载后唤醒 grab_thread 重新生成。作废期间的采集退回到 fp
+ *   profiler 停止时释放快照，不再维护，之后的 dlclose 不再作废快照
+ *   每个采集线程在自己的 hazard 中登记正在使用的快照，替换者等待旧快照不再被登记后释放
+ *   不拦截 dlopen：包装后调用者变成了本库，会影响 dlopen 按调用者的 RUNPATH/$ORIGIN 查找。
+ *   新加载模块中的栈帧在下一次更新之前找不到，只会使调用栈提前结束
+ */
+
+/**
+ * @brief 重新生成模块的快照，会调用 dl_iterate_phdr，不能在采样路径中调用
+ */
+void refresh_eh_frame_modules();
+
+/**
+ * @brief 模块有变化或者快照被作废时才重新生成，由 grab_thread 周期性调用
+ */
+void refresh_eh_frame_modules_if_changed();
+
+/**
+ * @brief 作废当前的快照，返回前保证没有采集在使用旧的快照
+ */
+void invalidate_eh_frame_modules();
+
+/**
+ * @brief 停止维护并释放快照，由 contention_profiler_stop 调用，下次启动时再由 refresh_eh_frame_modules 生成
+ */
+void disable_eh_frame_modules();
+
+/**
+ * @brief 使用模块的快照解析 DWARF CFI 采集调用栈，skip 的含义与 fp_stack_trace 相同
+ *
+ * @param frames 输出的返回地址
+ * @param max_frames frames 的长度
+ * @param skip 调用者与要采集的第一层之间还有几层，不包括函数自己
+ * @return int 栈帧数量，没有可用的快照（未生成、已作废或者不是 x86_64）时返回 -1
+ */
+__attribute__((noinline)) int eh_frame_stack_trace(void** frames, int max_frames, int skip);
+
+/**
+ * @brief dlclose 的实现，先作废快照再调用真正的 dlclose，之后唤醒 grab_thread 重新生成快照
+ *
+ * @param handle dlopen 返回的句柄
+ * @return int 与 dlclose 相同
+ */
+int dlclose_impl(void* handle);
+
+}  // namespace contention_prof
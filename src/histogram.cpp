@@ -0,0 +1,70 @@
+#include <string.h>
+#include <algorithm>
+#include "histogram.h"
+
+namespace contention_prof {
+
+ContentionHistogram::ContentionHistogram()
+    : total_(0)
+    , max_value_(-1)
+    , max_time_us_(0)
+    , max_tid_(0) {
+    memset(buckets_, 0, sizeof(buckets_));
+}
+
+int ContentionHistogram::get_bucket_index(uint64_t value) {
+    if (value < static_cast<uint64_t>(SUB_BUCKET_COUNT)) {
+        return static_cast<int>(value);
+    }
+    const int msb = 63 - __builtin_clzll(value);
+    const int sub = static_cast<int>((value >> (msb - SUB_BUCKET_BITS)) & (SUB_BUCKET_COUNT - 1));
+    return SUB_BUCKET_COUNT + (msb - SUB_BUCKET_BITS) * SUB_BUCKET_COUNT + sub;
+}
+
+uint64_t ContentionHistogram::get_bucket_lower_bound(int index) {
+    if (index < SUB_BUCKET_COUNT) {
+        return index;
+    }
+    const int msb = (index - SUB_BUCKET_COUNT) / SUB_BUCKET_COUNT + SUB_BUCKET_BITS;
+    const uint64_t sub = (index - SUB_BUCKET_COUNT) % SUB_BUCKET_COUNT;
+    return (static_cast<uint64_t>(SUB_BUCKET_COUNT) | sub) << (msb - SUB_BUCKET_BITS);
+}
+
+void ContentionHistogram::add(int64_t value, double weight, int64_t time_us, pid_t tid) {
+    if (value < 0) {
+        value = 0;
+    }
+    buckets_[get_bucket_index(value)] += weight;
+    total_ += weight;
+    if (value > max_value_) {
+        max_value_ = value;
+        max_time_us_ = time_us;
+        max_tid_ = tid;
+    }
+}
+
+int64_t ContentionHistogram::get_percentile(double ratio) const {
+    if (total_ <= 0) {
+        return 0;
+    }
+    const double target = total_ * ratio;
+    double accumulated = 0;
+    for (int i = 0; i < BUCKET_COUNT; ++i) {
+        accumulated += buckets_[i];
+        if (accumulated >= target && buckets_[i] > 0) {
+            // 假设桶内均匀分布，按 target 在桶内的位置线性插值，不超过真实的最大值
+            // 最后一个桶没有上界，直接使用最大值
+            if (i + 1 == BUCKET_COUNT) {
+                return max_value_;
+            }
+            const double lower_bound = static_cast<double>(get_bucket_lower_bound(i));
+            const double width = static_cast<double>(get_bucket_lower_bound(i + 1)) - lower_bound;
+            const double position = 1.0 - (accumulated - target) / buckets_[i];
+            const int64_t value = static_cast<int64_t>(lower_bound + width * std::max(0.0, position));
+            return value < max_value_ ? value : max_value_;
+        }
+    }
+    return max_value_;
+}
+
+}  // namespace contention_prof
@@ -0,0 +1,76 @@
+/**
+ * @file histogram.h
+ * @author noahyzhang
+ * @brief
+ * @version 0.1
+ * @date 2023-05-08
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace contention_prof {
+
+/**
+ * @brief 单个调用栈上每次等待时间的对数线性直方图
+ * 每个 2 的幂次区间再等分为 4 个桶，相对误差不超过 25%，小于 4 的值各占一个桶
+ * 同时记录最长的一次等待（发生时间和线程 id），方便与日志等对照
+ *
+ */
+class ContentionHistogram {
+public:
+    static const int SUB_BUCKET_BITS = 2;
+    static const int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    static const int BUCKET_COUNT = SUB_BUCKET_COUNT + (64 - SUB_BUCKET_BITS) * SUB_BUCKET_COUNT;
+
+    ContentionHistogram();
+
+    /**
+     * @brief 记录一次采样
+     *
+     * @param value 每次事件的等待时间（纳秒或 CPU 周期，与采样类型一致）
+     * @param weight 这次采样代表的事件数，即按照采样率还原后的次数
+     * @param time_us 发生的时间（gettimeofday）
+     * @param tid 发生的线程 id
+     */
+    void add(int64_t value, double weight, int64_t time_us, pid_t tid);
+
+    /**
+     * @brief 获取分位数，在所在的桶内按均匀分布线性插值，不超过最长的一次等待
+     * 只返回桶的下界时最多偏低 25%，插值后的误差不超过桶宽
+     *
+     * @param ratio 0 到 1 之间，比如 0.99
+     * @return int64_t
+     */
+    int64_t get_percentile(double ratio) const;
+
+    int64_t max_value() const { return max_value_; }
+    int64_t max_time_us() const { return max_time_us_; }
+    pid_t max_tid() const { return max_tid_; }
+
+    /**
+     * @brief 值所在的桶，桶相同的值对直方图的影响相同
+     *
+     * @param value
+     * @return int
+     */
+    static int get_bucket_index(uint64_t value);
+
+private:
+    static uint64_t get_bucket_lower_bound(int index);
+
+private:
+    // 使用 float 保存加权后的次数，一个直方图约 1KB
+    float buckets_[BUCKET_COUNT];
+    double total_;
+    int64_t max_value_;
+    int64_t max_time_us_;
+    pid_t max_tid_;
+};
+
+}  // namespace contention_prof
@@ -1,9 +1,37 @@
 #include "contention.h"
+#include "eh_frame.h"
 #include "hook_mutex.h"
+#include "stack_trace.h"
 
 using contention_prof::mutex_hook_init;
 using contention_prof::pthread_mutex_lock_impl;
 using contention_prof::pthread_mutex_unlock_impl;
+using contention_prof::pthread_mutex_timedlock_impl;
+using contention_prof::pthread_mutex_clocklock_impl;
+using contention_prof::pthread_spin_lock_impl;
+using contention_prof::pthread_spin_unlock_impl;
+using contention_prof::mtx_lock_impl;
+using contention_prof::mtx_timedlock_impl;
+using contention_prof::mtx_unlock_impl;
+using contention_prof::pthread_rwlock_rdlock_impl;
+using contention_prof::pthread_rwlock_wrlock_impl;
+using contention_prof::pthread_rwlock_tryrdlock_impl;
+using contention_prof::pthread_rwlock_trywrlock_impl;
+using contention_prof::pthread_rwlock_unlock_impl;
+using contention_prof::pthread_cond_wait_impl;
+using contention_prof::pthread_cond_timedwait_impl;
+using contention_prof::pthread_cond_signal_impl;
+using contention_prof::pthread_cond_broadcast_impl;
+using contention_prof::sem_wait_impl;
+using contention_prof::sem_timedwait_impl;
+using contention_prof::pthread_barrier_init_impl;
+using contention_prof::pthread_barrier_destroy_impl;
+using contention_prof::pthread_barrier_wait_impl;
+using contention_prof::dlclose_impl;
+using contention_prof::prevent_tail_call;
+
+// 以下的 hook 调用 xxx_impl 后都要用 prevent_tail_call 阻止尾调用，hook 在调用栈中固定占一层，
+// 采样的调用栈从这里开始，参考 SKIPPED_STACK_FRAMES
 
 // 系统自动调用
 __attribute__((constructor)) static void mutex_hook_constructor() {
@@ -12,10 +40,162 @@ __attribute__((constructor)) static void mutex_hook_constructor() {
 
 // 重写 pthread_mutex_lock 系统调用
 int pthread_mutex_lock(pthread_mutex_t *mutex)__THROWNL {
-    return pthread_mutex_lock_impl(mutex);
+    int res = pthread_mutex_lock_impl(mutex);
+    prevent_tail_call(res);
+    return res;
 }
 
 // 重写 pthread_mutex_unlock 系统调用
 int pthread_mutex_unlock(pthread_mutex_t *mutex)__THROWNL {
-    return pthread_mutex_unlock_impl(mutex);
+    int res = pthread_mutex_unlock_impl(mutex);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 重写 pthread_mutex_timedlock 系统调用，std::timed_mutex 使用它
+int pthread_mutex_timedlock(pthread_mutex_t *__restrict mutex,
+    const struct timespec *__restrict abstime)__THROWNL {
+    int res = pthread_mutex_timedlock_impl(mutex, abstime);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 重写 pthread_mutex_clocklock 系统调用
+int pthread_mutex_clocklock(pthread_mutex_t *__restrict mutex, clockid_t clockid,
+    const struct timespec *__restrict abstime)__THROWNL {
+    int res = pthread_mutex_clocklock_impl(mutex, clockid, abstime);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 重写 pthread_spin_lock 系统调用
+int pthread_spin_lock(pthread_spinlock_t *lock)__THROWNL {
+    int res = pthread_spin_lock_impl(lock);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 重写 pthread_spin_unlock 系统调用
+int pthread_spin_unlock(pthread_spinlock_t *lock)__THROWNL {
+    int res = pthread_spin_unlock_impl(lock);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 重写 C11 的 mtx_lock
+int mtx_lock(mtx_t *mtx) {
+    int res = mtx_lock_impl(mtx);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 重写 C11 的 mtx_timedlock
+int mtx_timedlock(mtx_t *__restrict mtx, const struct timespec *__restrict time_point) {
+    int res = mtx_timedlock_impl(mtx, time_point);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 重写 C11 的 mtx_unlock
+int mtx_unlock(mtx_t *mtx) {
+    int res = mtx_unlock_impl(mtx);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 重写 pthread_rwlock_rdlock 系统调用
+int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock)__THROWNL {
+    int res = pthread_rwlock_rdlock_impl(rwlock);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 重写 pthread_rwlock_wrlock 系统调用
+int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock)__THROWNL {
+    int res = pthread_rwlock_wrlock_impl(rwlock);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 重写 pthread_rwlock_tryrdlock 系统调用
+int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock)__THROWNL {
+    return pthread_rwlock_tryrdlock_impl(rwlock);
+}
+
+// 重写 pthread_rwlock_trywrlock 系统调用
+int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock)__THROWNL {
+    return pthread_rwlock_trywrlock_impl(rwlock);
+}
+
+// 重写 pthread_rwlock_unlock 系统调用
+int pthread_rwlock_unlock(pthread_rwlock_t *rwlock)__THROWNL {
+    int res = pthread_rwlock_unlock_impl(rwlock);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 重写 pthread_cond_wait 系统调用
+int pthread_cond_wait(pthread_cond_t *__restrict cond, pthread_mutex_t *__restrict mutex) {
+    int res = pthread_cond_wait_impl(cond, mutex);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 重写 pthread_cond_timedwait 系统调用
+int pthread_cond_timedwait(pthread_cond_t *__restrict cond, pthread_mutex_t *__restrict mutex,
+    const struct timespec *__restrict abstime) {
+    int res = pthread_cond_timedwait_impl(cond, mutex, abstime);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 重写 pthread_cond_signal 系统调用
+int pthread_cond_signal(pthread_cond_t *cond)__THROWNL {
+    int res = pthread_cond_signal_impl(cond);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 重写 pthread_cond_broadcast 系统调用
+int pthread_cond_broadcast(pthread_cond_t *cond)__THROWNL {
+    int res = pthread_cond_broadcast_impl(cond);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 重写 sem_wait 系统调用
+int sem_wait(sem_t *sem) {
+    int res = sem_wait_impl(sem);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 重写 sem_timedwait 系统调用
+int sem_timedwait(sem_t *__restrict sem, const struct timespec *__restrict abstime) {
+    int res = sem_timedwait_impl(sem, abstime);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 重写 pthread_barrier_init 系统调用，记录屏障的线程数
+int pthread_barrier_init(pthread_barrier_t *__restrict barrier,
+    const pthread_barrierattr_t *__restrict attr, unsigned int count)__THROW {
+    return pthread_barrier_init_impl(barrier, attr, count);
+}
+
+// 重写 pthread_barrier_destroy 系统调用
+int pthread_barrier_destroy(pthread_barrier_t *barrier)__THROW {
+    return pthread_barrier_destroy_impl(barrier);
+}
+
+// 重写 pthread_barrier_wait 系统调用
+int pthread_barrier_wait(pthread_barrier_t *barrier)__THROWNL {
+    int res = pthread_barrier_wait_impl(barrier);
+    prevent_tail_call(res);
+    return res;
+}
+
+// 重写 dlclose，卸载模块前先作废 eh_frame 的模块快照
+int dlclose(void *handle)__THROWNL {
+    return dlclose_impl(handle);
 }
@@ -12,6 +12,8 @@
 #pragma once
 
 #include <pthread.h>
+#include <semaphore.h>
+#include <threads.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -19,6 +21,39 @@ extern "C" {
 
 extern int pthread_mutex_lock(pthread_mutex_t *mutex)__THROWNL __nonnull((1));
 extern int pthread_mutex_unlock(pthread_mutex_t *mutex)__THROWNL __nonnull((1));
+extern int pthread_mutex_timedlock(pthread_mutex_t *__restrict mutex,
+    const struct timespec *__restrict abstime)__THROWNL __nonnull((1, 2));
+extern int pthread_mutex_clocklock(pthread_mutex_t *__restrict mutex, clockid_t clockid,
+    const struct timespec *__restrict abstime)__THROWNL __nonnull((1, 3));
+
+extern int pthread_spin_lock(pthread_spinlock_t *lock)__THROWNL __nonnull((1));
+extern int pthread_spin_unlock(pthread_spinlock_t *lock)__THROWNL __nonnull((1));
+
+extern int mtx_lock(mtx_t *mtx);
+extern int mtx_timedlock(mtx_t *__restrict mtx, const struct timespec *__restrict time_point);
+extern int mtx_unlock(mtx_t *mtx);
+
+extern int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock)__THROWNL __nonnull((1));
+extern int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock)__THROWNL __nonnull((1));
+extern int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock)__THROWNL __nonnull((1));
+extern int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock)__THROWNL __nonnull((1));
+extern int pthread_rwlock_unlock(pthread_rwlock_t *rwlock)__THROWNL __nonnull((1));
+
+extern int pthread_cond_wait(pthread_cond_t *__restrict cond,
+    pthread_mutex_t *__restrict mutex) __nonnull((1, 2));
+extern int pthread_cond_timedwait(pthread_cond_t *__restrict cond,
+    pthread_mutex_t *__restrict mutex, const struct timespec *__restrict abstime) __nonnull((1, 2, 3));
+extern int pthread_cond_signal(pthread_cond_t *cond)__THROWNL __nonnull((1));
+extern int pthread_cond_broadcast(pthread_cond_t *cond)__THROWNL __nonnull((1));
+
+extern int sem_wait(sem_t *sem) __nonnull((1));
+extern int sem_timedwait(sem_t *__restrict sem, const struct timespec *__restrict abstime) __nonnull((1, 2));
+
+extern int pthread_barrier_init(pthread_barrier_t *__restrict barrier,
+    const pthread_barrierattr_t *__restrict attr, unsigned int count)__THROW __nonnull((1));
+extern int pthread_barrier_destroy(pthread_barrier_t *barrier)__THROW __nonnull((1));
+extern int pthread_barrier_wait(pthread_barrier_t *barrier)__THROWNL __nonnull((1));
+extern int dlclose(void *handle)__THROWNL __nonnull((1));
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,181 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <gflags/gflags.h>
+#include "common/common.h"
+#include "common/log.h"
+#include "collector.h"
+#include "profiler.h"
+
+// LD_PRELOAD 模式：不需要重新链接和修改代码，通过环境变量配置，通过实时信号开始/停止
+//
+// LD_PRELOAD=libcontention_prof.so CONTENTION_PROF_SIGNAL=3 ./server
+// kill -s $((`kill -l RTMIN` + 3)) <pid>    # 开始，再发一次停止
+//
+// 环境变量:
+// CONTENTION_PROF_OUTPUT: 输出文件的前缀，默认为 ./contention.prof
+//     每次 profile 输出到 "前缀.pid.序号"，其它采样类型再加上类型名后缀
+// CONTENTION_PROF_RATE: 每秒期望的采样数，覆盖 collector_expected_per_second
+// CONTENTION_PROF_DURATION: 每次 profile 持续的秒数，到时间自动停止，默认 0 表示直到下一个信号
+// CONTENTION_PROF_SIGNAL: 实时信号的编号 N，使用 SIGRTMIN+N 切换开始/停止
+// CONTENTION_PROF_START: 非 0 时在加载后立即开始一次 profile
+// CONTENTION_PROF_HOLD_TIME: 非 0 时同时采样所有锁的持有时间，参考 hold_time_profile
+// CONTENTION_PROF_UNWINDER: 采集调用栈的方式，auto、fp、eh_frame 或者 backtrace，参考 stack_unwinder
+// CONTENTION_PROF_STACK_DEPTH: 采集的栈帧数量，覆盖 stack_max_depth
+// CONTENTION_PROF_STACK_SKIP: 额外跳过最内层的栈帧数量，覆盖 stack_skip_frames
+//
+// 信号处理函数中只修改一个原子变量，开始/停止以及文件操作都在 grab_thread 中执行
+// 未开始 profile 时，hook 中的开销仍然只有 !g_cp 的判断
+
+namespace contention_prof {
+
+DECLARE_int32(collector_expected_per_second);
+DECLARE_bool(hold_time_profile);
+DECLARE_string(stack_unwinder);
+DECLARE_int32(stack_max_depth);
+DECLARE_int32(stack_skip_frames);
+
+// 这里的全局变量都不能有构造函数，preload_init 执行时它们可能还没有初始化
+// 信号处理函数收到的切换请求数
+static std::atomic<int> g_toggle_requests(0);
+static const char* g_output_prefix = "./contention.prof";
+static int64_t g_duration_us = 0;
+// 本次 profile 自动停止的时间，0 表示不自动停止
+static int64_t g_stop_time_us = 0;
+static int g_session_index = 0;
+// FLAGS_stack_unwinder 是 std::string，构造函数中不能赋值，开始 profile 时再设置
+static const char* g_stack_unwinder = nullptr;
+
+static void on_toggle_signal(int) {
+    g_toggle_requests.fetch_add(1, std::memory_order_relaxed);
+    // 没有 profile 时 grab_thread 一直睡眠，需要唤醒它执行 preload_periodic_task
+    wakeup_collector();
+}
+
+static void start_session() {
+    if (g_stack_unwinder != nullptr) {
+        FLAGS_stack_unwinder = g_stack_unwinder;
+    }
+    std::string filename = std::string(g_output_prefix) + '.' + std::to_string(getpid())
+        + '.' + std::to_string(g_session_index++);
+    if (!contention_profiler_start(filename.c_str())) {
+        LOG(ERROR) << "start contention profiler failed, filename: " << filename;
+        return;
+    }
+    g_stop_time_us = g_duration_us > 0 ? Util::get_monotonic_time_us() + g_duration_us : 0;
+    LOG(INFO) << "contention profiler started, filename: " << filename;
+}
+
+static void stop_session() {
+    g_stop_time_us = 0;
+    contention_profiler_stop();
+    ContentionProfilerStats stats;
+    get_contention_profiler_stats(&stats);
+    LOG(INFO) << "contention profiler stopped, mutex_map_collisions: " << stats.mutex_map_collisions
+        << ", mutex_map_drops: " << stats.mutex_map_drops
+        << ", mutex_map_capacity: " << stats.mutex_map_capacity
+        << ", interned_stacks: " << stats.interned_stacks
+        << ", interned_stack_bytes: " << stats.interned_stack_bytes
+        << ", stack_memo_hits: " << stats.stack_memo_hits
+        << ", stack_memo_mismatches: " << stats.stack_memo_mismatches;
+}
+
+// 在 grab_thread 中执行
+static void preload_periodic_task() {
+    // 两次信号之间 grab_thread 没来得及处理时，只看奇偶
+    if (g_toggle_requests.exchange(0, std::memory_order_relaxed) & 1) {
+        if (g_cp) {
+            stop_session();
+        } else {
+            start_session();
+        }
+    }
+    if (g_cp && g_stop_time_us && static_cast<int64_t>(Util::get_monotonic_time_us()) >= g_stop_time_us) {
+        stop_session();
+    }
+}
+
+static int64_t get_env_int(const char* name, int64_t default_value) {
+    const char* value = getenv(name);
+    if (value == nullptr || *value == '\0') {
+        return default_value;
+    }
+    return strtoll(value, nullptr, 10);
+}
+
+// 在构造函数中执行，其它编译单元的全局对象（比如 LOG 用到的文件流）可能还没有初始化，只能用 fprintf
+static bool install_toggle_signal(int signo) {
+    struct sigaction old_action;
+    if (sigaction(signo, nullptr, &old_action) != 0) {
+        fprintf(stderr, "contention_prof: sigaction failed, signo: %d, err: %s\n", signo, strerror(errno));
+        return false;
+    }
+    // 不覆盖程序自己设置的信号处理函数
+    if (old_action.sa_handler != SIG_DFL && old_action.sa_handler != SIG_IGN) {
+        fprintf(stderr, "contention_prof: signal %d is already in use\n", signo);
+        return false;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_toggle_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(signo, &action, nullptr) != 0) {
+        fprintf(stderr, "contention_prof: sigaction failed, signo: %d, err: %s\n", signo, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// 没有设置 CONTENTION_PROF_SIGNAL 和 CONTENTION_PROF_START 时什么都不做，不影响直接链接使用的方式
+__attribute__((constructor)) static void preload_init() {
+    const int64_t signal_offset = get_env_int("CONTENTION_PROF_SIGNAL", -1);
+    const bool start_now = get_env_int("CONTENTION_PROF_START", 0) != 0;
+    if (signal_offset < 0 && !start_now) {
+        return;
+    }
+    const char* output = getenv("CONTENTION_PROF_OUTPUT");
+    if (output != nullptr && *output != '\0') {
+        g_output_prefix = output;
+    }
+    const int64_t rate = get_env_int("CONTENTION_PROF_RATE", 0);
+    if (rate > 0) {
+        FLAGS_collector_expected_per_second = rate;
+    }
+    if (get_env_int("CONTENTION_PROF_HOLD_TIME", 0) != 0) {
+        FLAGS_hold_time_profile = true;
+    }
+    const int64_t stack_depth = get_env_int("CONTENTION_PROF_STACK_DEPTH", 0);
+    if (stack_depth > 0) {
+        FLAGS_stack_max_depth = stack_depth;
+    }
+    const int64_t stack_skip = get_env_int("CONTENTION_PROF_STACK_SKIP", 0);
+    if (stack_skip > 0) {
+        FLAGS_stack_skip_frames = stack_skip;
+    }
+    const char* unwinder = getenv("CONTENTION_PROF_UNWINDER");
+    if (unwinder != nullptr && *unwinder != '\0') {
+        g_stack_unwinder = unwinder;
+    }
+    g_duration_us = get_env_int("CONTENTION_PROF_DURATION", 0) * 1000000L;
+    if (signal_offset >= 0) {
+        const int signo = SIGRTMIN + signal_offset;
+        if (signo > SIGRTMAX) {
+            fprintf(stderr, "contention_prof: CONTENTION_PROF_SIGNAL %ld is out of range\n", signal_offset);
+        } else {
+            install_toggle_signal(signo);
+        }
+    }
+    if (start_now) {
+        g_toggle_requests.fetch_add(1, std::memory_order_relaxed);
+    }
+    // 会创建 grab_thread
+    add_collector_periodic_task(preload_periodic_task);
+}
+
+}  // namespace contention_prof
@@ -1,7 +1,13 @@
 #include <math.h>
+#include <string.h>
 #include <memory>
+#include <gflags/gflags.h>
 #include "common/log.h"
+#include "collector.h"
+#include "eh_frame.h"
 #include "profiler.h"
+#include "stack_table.h"
+#include "stack_trace.h"
 
 namespace contention_prof {
 
@@ -10,8 +16,23 @@ ContentionProfiler* g_cp = nullptr;
 pthread_mutex_t g_cp_mutex = PTHREAD_MUTEX_INITIALIZER;
 uint64_t g_cp_version = 0;
 
+DEFINE_int64(adaptive_stack_hot_wait_us, 10000, "With adaptive_stack_depth, estimated wait time after which "
+    "a shallow stack gets full stacks for the rest of the profile");
+
 const size_t MAX_CACHED_CONTENTIONS = 512;
-const int SKIPPED_STACK_FRAMES = 2;
+
+size_t ContentionHash::operator()(const SampledContention* c) const {
+    return c->hash_code();
+}
+
+bool ContentionEqual::operator()(const SampledContention* c1, const SampledContention* c2) const {
+    return c1->kind == c2->kind && c1->stack_id == c2->stack_id && c1->shallow_stack == c2->shallow_stack;
+}
+
+// 写在被截断的浅调用栈的根部，pprof 中显示为这个函数，不会把截断处误认为调用栈的根
+extern "C" __attribute__((noinline, used)) void contention_prof_truncated_stack() {
+    asm volatile("");
+}
 
 ContentionProfiler::ContentionProfiler(const char* name)
     : init_(false)
@@ -23,52 +44,176 @@ ContentionProfiler::~ContentionProfiler() {
         return;
     }
     flush_to_disk(true);
-    file_stream_.close();
+    for (int i = 0; i < SAMPLE_KIND_COUNT; ++i) {
+        if (file_streams_[i].is_open()) {
+            file_streams_[i].close();
+        }
+        if (histogram_streams_[i].is_open()) {
+            histogram_streams_[i].close();
+        }
+    }
 }
 
 void ContentionProfiler::init_if_needed() {
     if (!init_) {
+        get_stream(SAMPLE_KIND_MUTEX);
+        init_ = true;
+    }
+}
+
+// SAMPLE_KIND_MUTEX 写入用户指定的文件，其余类型写入 "文件名.类型名"
+std::string ContentionProfiler::get_filename(int kind) const {
+    if (kind == SAMPLE_KIND_MUTEX) {
+        return filename_;
+    }
+    return filename_ + '.' + get_sample_kind_name(kind);
+}
+
+// 第一次写入某种采样类型时才创建对应的文件
+std::ofstream& ContentionProfiler::get_stream(int kind) {
+    std::ofstream& file_stream = file_streams_[kind];
+    if (!file_stream.is_open()) {
+        const std::string filename = get_filename(kind);
         try {
-            std::remove(filename_.c_str());
-            file_stream_.open(filename_, std::ofstream::out | std::ofstream::app);
+            std::remove(filename.c_str());
+            file_stream.open(filename, std::ofstream::out | std::ofstream::app);
         } catch(...) {
-            // LOG(ERROR) << "";
-            return;
+            LOG(ERROR) << "open profile file: " << filename << " failed";
+            return file_stream;
         }
-        file_stream_ << "--- contention\ncycles/second=10000000000\n";
-        init_ = true;
+        // 以 CPU 周期为单位的数据，写入真实的 CPU 频率，pprof 据此换算成时间
+        if (is_cpu_cycles_sample_kind(kind)) {
+            file_stream << "--- contention\ncycles/second="
+                << static_cast<uint64_t>(Util::get_cpu_cycles_per_second()) << '\n';
+        } else {
+            file_stream << "--- contention\ncycles/second=10000000000\n";
+        }
+    }
+    return file_stream;
+}
+
+// 直方图文件在 profile 结束时写入，每行对应 profile 文件中调用栈相同的所有行
+// <次数> p50=<ns> p99=<ns> max=<ns> max_time_us=<us> max_tid=<tid> @ <调用栈>
+// p50、p99 在对数线性直方图的桶内线性插值得到，参考 ContentionHistogram::get_percentile
+std::ofstream& ContentionProfiler::get_histogram_stream(int kind) {
+    std::ofstream& file_stream = histogram_streams_[kind];
+    if (!file_stream.is_open()) {
+        const std::string filename = get_filename(kind) + ".hist";
+        try {
+            std::remove(filename.c_str());
+            file_stream.open(filename, std::ofstream::out | std::ofstream::app);
+        } catch(...) {
+            LOG(ERROR) << "open histogram file: " << filename << " failed";
+        }
+    }
+    return file_stream;
+}
+
+// 输出调用栈并换行，profiler 自身的栈帧在采集时已经跳过
+// 被截断的浅调用栈在根部加上 contention_prof_truncated_stack，地址加 1 是因为 pprof 把地址当作返回地址减 1 后查找符号
+static void write_stack(std::ofstream& file_stream, uint32_t stack_id, bool shallow_stack) {
+    void* const* frames = nullptr;
+    const int frames_count = get_interned_stack(stack_id, &frames);
+    for (int i = 0; i < frames_count; ++i) {
+        file_stream << ' ' << frames[i];
     }
+    if (shallow_stack) {
+        file_stream << ' ' << reinterpret_cast<void*>(
+            reinterpret_cast<uintptr_t>(&contention_prof_truncated_stack) + 1);
+    }
+    file_stream << '\n';
+}
+
+// 以 CPU 周期为单位的采样类型，直方图中换算成纳秒输出
+void ContentionProfiler::write_histogram(const StackHistogram& stack_histogram) {
+    const ContentionHistogram& histogram = stack_histogram.histogram;
+    const double ns_per_unit = is_cpu_cycles_sample_kind(stack_histogram.kind)
+        ? 1E9 / Util::get_cpu_cycles_per_second() : 1;
+    std::ofstream& file_stream = get_histogram_stream(stack_histogram.kind);
+    file_stream << static_cast<size_t>(ceil(stack_histogram.count))
+        << " p50=" << static_cast<int64_t>(histogram.get_percentile(0.5) * ns_per_unit)
+        << " p99=" << static_cast<int64_t>(histogram.get_percentile(0.99) * ns_per_unit)
+        << " max=" << static_cast<int64_t>(histogram.max_value() * ns_per_unit)
+        << " max_time_us=" << histogram.max_time_us()
+        << " max_tid=" << histogram.max_tid() << " @";
+    write_stack(file_stream, stack_histogram.stack_id, stack_histogram.shallow_stack);
 }
 
 void ContentionProfiler::dump_and_destroy(SampledContention* c) {
     init_if_needed();
-    auto iter = hash_set.find(c);
-    if (iter != hash_set.end()) {
-        (*iter)->duration_ns += c->duration_ns;
-        (*iter)->count += c->count;
-        c->destroy();
+    SampledContention* merged = c;
+    StackHistogram* stack_histogram = nullptr;
+    auto iter = hash_map.find(c);
+    if (iter != hash_map.end()) {
+        merged = iter->first;
+        merged->duration_ns += c->duration_ns;
+        merged->count += c->count;
+        stack_histogram = iter->second;
     } else {
-        hash_set.insert(c);
+        // 与 ContentionEqual 一致，按采样类型、调用栈和是否被截断区分
+        const uint64_t key = (static_cast<uint64_t>(c->stack_id) * SAMPLE_KIND_COUNT + c->kind) * 2
+            + c->shallow_stack;
+        auto histogram_iter = histogram_map_.find(key);
+        if (histogram_iter == histogram_map_.end()) {
+            histogram_iter = histogram_map_.emplace(key, StackHistogram()).first;
+            histogram_iter->second.kind = c->kind;
+            histogram_iter->second.stack_id = c->stack_id;
+            histogram_iter->second.shallow_stack = c->shallow_stack;
+            histogram_iter->second.count = 0;
+        }
+        stack_histogram = &histogram_iter->second;
+        hash_map[c] = stack_histogram;
+    }
+    stack_histogram->count += c->count;
+    stack_histogram->histogram.add(c->event_duration_ns, c->count, c->time_us, c->tid);
+    if (c->shallow_stack) {
+        mark_hot_shallow_stack(c);
     }
-    if (hash_set.size() > MAX_CACHED_CONTENTIONS) {
+    if (merged != c) {
+        c->destroy();
+    }
+    if (hash_map.size() > MAX_CACHED_CONTENTIONS) {
         flush_to_disk(false);
     }
 }
 
+// 浅调用栈在本次 profile 中累计的等待时间（按采样率还原，所有采样类型合计）超过 adaptive_stack_hot_wait_us 时
+// 标记为热点，之后经过它的采样都采集完整的调用栈。累计值保存在 shallow_wait_ns_ 中，不随 hash_map 写入文件清零
+void ContentionProfiler::mark_hot_shallow_stack(const SampledContention* c) {
+    if (get_interned_stack_mark(c->stack_id) == g_cp_version) {
+        return;
+    }
+    const double ns_per_unit = is_cpu_cycles_sample_kind(c->kind) ? 1E9 / Util::get_cpu_cycles_per_second() : 1;
+    double& wait_ns = shallow_wait_ns_[c->stack_id];
+    wait_ns += c->duration_ns * ns_per_unit;
+    if (wait_ns >= FLAGS_adaptive_stack_hot_wait_us * 1000.0) {
+        set_interned_stack_mark(c->stack_id, g_cp_version);
+        shallow_wait_ns_.erase(c->stack_id);
+    }
+}
+
 void ContentionProfiler::flush_to_disk(bool ending) {
-    if (!hash_set.empty()) {
-        for (const auto c : hash_set) {
-            file_stream_ << c->duration_ns << ' ' << static_cast<size_t>(ceil(c->count)) << " @";
-            for (int i = SKIPPED_STACK_FRAMES; i < c->frames_count; ++i) {
-                file_stream_ << ' ' << reinterpret_cast<void*>(c->stack[i]);
-            }
-            file_stream_ << '\n';
+    if (!hash_map.empty()) {
+        for (const auto& item : hash_map) {
+            SampledContention* c = item.first;
+            std::ofstream& file_stream = get_stream(c->kind);
+            file_stream << c->duration_ns << ' ' << static_cast<size_t>(ceil(c->count)) << " @";
+            write_stack(file_stream, c->stack_id, c->shallow_stack);
             c->destroy();
         }
-        hash_set.clear();
+        hash_map.clear();
     }
     if (ending) {
-        file_stream_ << Util::get_self_maps();
+        for (const auto& item : histogram_map_) {
+            write_histogram(item.second);
+        }
+        histogram_map_.clear();
+        const std::string maps = Util::get_self_maps();
+        for (int i = 0; i < SAMPLE_KIND_COUNT; ++i) {
+            if (file_streams_[i].is_open()) {
+                file_streams_[i] << maps;
+            }
+        }
     }
 }
 
@@ -80,16 +225,28 @@ bool contention_profiler_start(const char* filename) {
         return false;
     }
     std::unique_ptr<ContentionProfiler> ctx(new ContentionProfiler(filename));
+    // 在开始采样前生成 eh_frame 的模块快照，之后由 grab_thread 在模块变化时更新
+    // grab_thread 同时每一轮取走线程内预聚合缓冲中的记录，并按需扩大锁表
+    static pthread_once_t s_periodic_tasks_once = PTHREAD_ONCE_INIT;
+    pthread_once(&s_periodic_tasks_once, []() {
+        add_collector_periodic_task(refresh_eh_frame_modules_if_changed);
+        add_collector_periodic_task(drain_pending_samples);
+        add_collector_periodic_task(grow_mutex_map_if_needed);
+    });
+    refresh_eh_frame_modules();
     {
         pthread_mutex_lock(&g_cp_mutex);
         if (g_cp) {
             pthread_mutex_unlock(&g_cp_mutex);
             return false;
         }
+        // 采样在 g_cp 设置之后才开始，这之前解析 stack_unwinder，采样时不再读取它
+        init_stack_unwinder();
         g_cp = ctx.release();
         ++g_cp_version;
         pthread_mutex_unlock(&g_cp_mutex);
     }
+    set_collector_active(true);
     return true;
 }
 
@@ -101,7 +258,12 @@ void contention_profiler_stop() {
             ctx = g_cp;
             g_cp = nullptr;
             pthread_mutex_unlock(&g_cp_mutex);
+            set_collector_active(false);
 
+            disable_eh_frame_modules();
+            clear_pthread_contention_sites();
+            // 还留在线程内预聚合缓冲中的记录
+            flush_pending_samples(ctx);
             ctx->init_if_needed();
             delete ctx;
             return;
@@ -13,11 +13,34 @@
 
 #include <string>
 #include <fstream>
-#include <unordered_set>
-#include "collector.h"
+#include <unordered_map>
+#include <pthread.h>
+#include "histogram.h"
+#include "sample_kind.h"
 
 namespace contention_prof {
 
+struct SampledContention;
+
+// 按照采样类型和调用栈聚合
+struct ContentionHash {
+    size_t operator()(const SampledContention* c) const;
+};
+
+struct ContentionEqual {
+    bool operator()(const SampledContention* c1, const SampledContention* c2) const;
+};
+
+// 一个调用栈在整个 profile 中的等待时间直方图
+struct StackHistogram {
+    int kind;
+    uint32_t stack_id;
+    bool shallow_stack;
+    // 按采样率还原后的次数
+    double count;
+    ContentionHistogram histogram;
+};
+
 class ContentionProfiler {
 public:
     explicit ContentionProfiler(const char* name);
@@ -25,12 +48,27 @@ public:
     void dump_and_destroy(SampledContention* c);
     void flush_to_disk(bool ending);
     void init_if_needed();
+private:
+    std::string get_filename(int kind) const;
+    std::ofstream& get_stream(int kind);
+    std::ofstream& get_histogram_stream(int kind);
+    void write_histogram(const StackHistogram& stack_histogram);
+    void mark_hot_shallow_stack(const SampledContention* c);
 private:
     bool init_;
     bool first_write_;
     std::string filename_;
-    std::ofstream file_stream_;
-    std::unordered_set<SampledContention*> hash_set;
+    // 每种采样类型输出到一个单独的 profile 文件，下标为 SampleKind
+    std::ofstream file_streams_[SAMPLE_KIND_COUNT];
+    // 每种采样类型的直方图输出到 "profile 文件名.hist"，pprof 不认识这些数据，不能写在 profile 文件中
+    std::ofstream histogram_streams_[SAMPLE_KIND_COUNT];
+    // 第一个到达的采样作为聚合的结果，同时指向它的调用栈在 histogram_map_ 中的直方图
+    std::unordered_map<SampledContention*, StackHistogram*, ContentionHash, ContentionEqual> hash_map;
+    // 按采样类型和调用栈聚合的直方图，hash_map 写入文件时不清空，profile 结束时才写入，
+    // 直方图无法像 profile 文件中的行那样由 pprof 合并，中途写入会把同一个调用栈拆成多行
+    std::unordered_map<uint64_t, StackHistogram> histogram_map_;
+    // 还没有变热的浅调用栈在本次 profile 中累计的等待时间（纳秒），参考 mark_hot_shallow_stack
+    std::unordered_map<uint32_t, double> shallow_wait_ns_;
 };
 
 extern ContentionProfiler* g_cp;
@@ -40,4 +78,58 @@ extern uint64_t g_cp_version;
 bool contention_profiler_start(const char* filename);
 void contention_profiler_stop();
 
+const int LOCK_DEPTH_HISTOGRAM_SIZE = 16;
+// 采样率控制器按锁地址的哈希分层的层数，参考 CollectorSpeedLimit
+const int SAMPLING_STRATA_COUNT = 16;
+
+/**
+ * @brief profiler 自身的统计，进程内累计，不随 profile 的开始和结束清零
+ *
+ */
+struct ContentionProfilerStats {
+    // TLS 已满时使用的全局表中，探测时遇到被其它锁占用的表项的次数
+    int64_t mutex_map_collisions;
+    // 全局表中所有表都没有空位而丢弃的采样数
+    int64_t mutex_map_drops;
+    // 全局表当前的总容量
+    size_t mutex_map_capacity;
+    // 线程内的登记项（包括借用的 chunk）用满，只能使用全局表的次数
+    int64_t tls_site_overflows;
+    // 调用栈表中的调用栈数量、占用的内存，以及表已满而丢弃调用栈的次数
+    size_t interned_stacks;
+    size_t interned_stack_bytes;
+    int64_t stack_table_drops;
+    // 调用栈缓存（stack_memo）的命中、未命中、校验，以及校验发现缓存过期的次数
+    int64_t stack_memo_hits;
+    int64_t stack_memo_misses;
+    int64_t stack_memo_verifications;
+    int64_t stack_memo_mismatches;
+    // adaptive_stack_depth 下只采集了浅调用栈的采样数，以及浅调用栈变热后采集完整调用栈的采样数
+    int64_t shallow_stack_samples;
+    int64_t deepened_stack_samples;
+    // 采样交给 grab_thread 的环形队列（collector_sample_ring）已满而丢弃的采样数
+    int64_t sample_ring_overflows;
+    // 在线程内被合并到已有记录中的采样数（sample_pre_aggregation）
+    int64_t pre_aggregated_samples;
+    // 采样率控制器每一层当前的采样范围（COLLECTOR_SAMPLING_BASE 表示全部采样）和估计的每秒事件数
+    int64_t sampling_ranges[SAMPLING_STRATA_COUNT];
+    double sampling_event_rates[SAMPLING_STRATA_COUNT];
+    // 被采样的加锁发生时，线程持有的锁的数量（包括这次加的锁），最后一项为大于等于它的合计
+    int64_t lock_depth_histogram[LOCK_DEPTH_HISTOGRAM_SIZE];
+};
+
+void get_contention_profiler_stats(ContentionProfilerStats* stats);
+
+// 把各个线程预聚合缓冲（sample_pre_aggregation）中的记录交给 collector，由 grab_thread 每一轮调用
+void drain_pending_samples();
+
+// 结束 profile 时把预聚合缓冲中的记录直接写入 cp，调用前 g_cp 已经不再指向 cp
+void flush_pending_samples(ContentionProfiler* cp);
+
+// 线程内记录满时使用的锁表快满时，分配下一个表，由 grab_thread 每一轮调用，加锁路径中不分配
+void grow_mutex_map_if_needed();
+
+// 结束 profile 时清空线程内记录满时使用的锁表，之前 profile 的表项不会再被解锁删除，留着会使解锁一直查表
+void clear_pthread_contention_sites();
+
 }  // namespace contention_prof
@@ -0,0 +1,119 @@
+/**
+ * @file sample_kind.h
+ * @author noahyzhang
+ * @brief
+ * @version 0.1
+ * @date 2023-05-08
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+namespace contention_prof {
+
+/**
+ * @brief 采样数据的类型
+ * 不同类型的数据在聚合时互不合并，并且输出到各自的 profile 文件中
+ *
+ */
+enum SampleKind {
+    // pthread_mutex_lock 的等待
+    SAMPLE_KIND_MUTEX = 0,
+    // 读锁的等待，阻塞它的是写锁持有者
+    SAMPLE_KIND_RWLOCK_RD_BLOCKED_BY_WR,
+    // 读锁的等待，没有写锁持有者，阻塞它的是排队中的写者（写优先）
+    SAMPLE_KIND_RWLOCK_RD_BLOCKED_BY_WAITING_WR,
+    // 写锁的等待，阻塞它的是读锁持有者
+    SAMPLE_KIND_RWLOCK_WR_BLOCKED_BY_RD,
+    // 写锁的等待，阻塞它的是写锁持有者
+    SAMPLE_KIND_RWLOCK_WR_BLOCKED_BY_WR,
+    // pthread_cond_wait 中等待 signal/broadcast 的时间
+    SAMPLE_KIND_COND_WAIT_SIGNAL,
+    // pthread_cond_wait 被唤醒后重新获取 mutex 的时间
+    SAMPLE_KIND_COND_REACQUIRE,
+    // signal/broadcast 唤醒的等待者数量，归因到唤醒方的调用栈，只有次数没有时间
+    SAMPLE_KIND_COND_WAKEUP,
+    // 被唤醒后没有做任何事情又回去等待的次数（惊群），归因到唤醒方的调用栈
+    // 时间为被唤醒到再次等待之间浪费的时间
+    SAMPLE_KIND_COND_WASTED_WAKEUP,
+    // pthread_mutex_timedlock/clocklock、mtx_timedlock 在超时前获取到锁的等待
+    SAMPLE_KIND_TIMEDLOCK_ACQUIRED,
+    // pthread_mutex_timedlock/clocklock、mtx_timedlock 超时（ETIMEDOUT）的等待
+    SAMPLE_KIND_TIMEDLOCK_TIMEDOUT,
+    // pthread_spin_lock 自旋消耗的 CPU 周期，与阻塞等待的时间分开统计
+    SAMPLE_KIND_SPIN,
+    // sem_wait/sem_timedwait 因为信号量为 0（队列空或满）而等待
+    SAMPLE_KIND_SEM_WAIT,
+    // sem_timedwait 超时的等待
+    SAMPLE_KIND_SEM_TIMEDOUT,
+    // pthread_barrier_wait 等待其它线程到达（负载不均衡），归因到最后到达的线程的调用栈
+    SAMPLE_KIND_BARRIER_WAIT,
+    // 与 SAMPLE_KIND_MUTEX、SAMPLE_KIND_TIMEDLOCK_ACQUIRED 是同一次等待，
+    // 但归因到等待期间持有锁的线程（最后一个在解锁时看到有等待者的线程）解锁时的调用栈
+    SAMPLE_KIND_MUTEX_HOLDER,
+    // 加锁成功到解锁之间的时间（临界区长度），不论加锁时是否有竞争，需要打开 hold_time_profile
+    SAMPLE_KIND_HOLD,
+    SAMPLE_KIND_COUNT,
+};
+
+/**
+ * @brief 获取采样类型的名字，也作为 profile 文件名的后缀
+ * SAMPLE_KIND_MUTEX 使用用户指定的文件名，不加后缀
+ *
+ * @param kind
+ * @return const char*
+ */
+inline const char* get_sample_kind_name(int kind) {
+    switch (kind) {
+    case SAMPLE_KIND_MUTEX:
+        return "mutex";
+    case SAMPLE_KIND_RWLOCK_RD_BLOCKED_BY_WR:
+        return "rwlock_rd_blocked_by_wr";
+    case SAMPLE_KIND_RWLOCK_RD_BLOCKED_BY_WAITING_WR:
+        return "rwlock_rd_blocked_by_waiting_wr";
+    case SAMPLE_KIND_RWLOCK_WR_BLOCKED_BY_RD:
+        return "rwlock_wr_blocked_by_rd";
+    case SAMPLE_KIND_RWLOCK_WR_BLOCKED_BY_WR:
+        return "rwlock_wr_blocked_by_wr";
+    case SAMPLE_KIND_COND_WAIT_SIGNAL:
+        return "cond_wait_signal";
+    case SAMPLE_KIND_COND_REACQUIRE:
+        return "cond_reacquire";
+    case SAMPLE_KIND_COND_WAKEUP:
+        return "cond_wakeup";
+    case SAMPLE_KIND_COND_WASTED_WAKEUP:
+        return "cond_wasted_wakeup";
+    case SAMPLE_KIND_TIMEDLOCK_ACQUIRED:
+        return "timedlock_acquired";
+    case SAMPLE_KIND_TIMEDLOCK_TIMEDOUT:
+        return "timedlock_timedout";
+    case SAMPLE_KIND_SPIN:
+        return "spin";
+    case SAMPLE_KIND_SEM_WAIT:
+        return "sem_wait";
+    case SAMPLE_KIND_SEM_TIMEDOUT:
+        return "sem_timedout";
+    case SAMPLE_KIND_BARRIER_WAIT:
+        return "barrier_wait";
+    case SAMPLE_KIND_MUTEX_HOLDER:
+        return "mutex_holder";
+    case SAMPLE_KIND_HOLD:
+        return "hold";
+    default:
+        return "unknown";
+    }
+}
+
+/**
+ * @brief 采样数据的时间单位是否为 CPU 周期（Util::get_cpu_cycles），否则为纳秒
+ *
+ * @param kind
+ * @return bool
+ */
+inline bool is_cpu_cycles_sample_kind(int kind) {
+    return kind == SAMPLE_KIND_SPIN;
+}
+
+}  // namespace contention_prof
@@ -0,0 +1,93 @@
+#include <string.h>
+#include <atomic>
+#include <gflags/gflags.h>
+#include "common/fast_rand.h"
+#include "common/murmurhash3.h"
+#include "common/thread_local.h"
+#include "stack_table.h"
+#include "stack_memo.h"
+
+namespace contention_prof {
+
+DEFINE_bool(stack_memo, false, "Reuse the full stack of an already-seen call chain, recognized by its "
+    "innermost return addresses and stack offset, instead of a full unwind");
+DEFINE_int32(stack_memo_verify_interval, 64, "Verify about one in N stack memo hits with a full unwind, "
+    "0 to never verify");
+
+// 每个线程的缓存为直接映射，STACK_MEMO_SIZE 项
+const size_t STACK_MEMO_SIZE = 64;
+
+struct StackMemoEntry {
+    StackMemoKey key;
+    uint32_t stack_id;
+};
+
+// 第一次使用时分配，线程退出时释放
+static __thread StackMemoEntry* tls_stack_memo = nullptr;
+
+static std::atomic<int64_t> g_stack_memo_hits(0);
+static std::atomic<int64_t> g_stack_memo_misses(0);
+static std::atomic<int64_t> g_stack_memo_verifications(0);
+static std::atomic<int64_t> g_stack_memo_mismatches(0);
+
+static void free_stack_memo(void* arg) {
+    delete[] static_cast<StackMemoEntry*>(arg);
+    tls_stack_memo = nullptr;
+}
+
+static StackMemoEntry* get_stack_memo() {
+    if (tls_stack_memo == nullptr) {
+        tls_stack_memo = new StackMemoEntry[STACK_MEMO_SIZE]();
+        thread_atexit(free_stack_memo, tls_stack_memo);
+    }
+    return tls_stack_memo;
+}
+
+static StackMemoEntry& get_stack_memo_entry(const StackMemoKey& key) {
+    uint32_t hash = 0;
+    MurmurHash3_x86_32(key.frames, sizeof(void*) * key.frames_count, static_cast<uint32_t>(key.stack_offset), &hash);
+    return get_stack_memo()[hash % STACK_MEMO_SIZE];
+}
+
+static bool is_same_key(const StackMemoKey& k1, const StackMemoKey& k2) {
+    return k1.frames_count == k2.frames_count && k1.stack_offset == k2.stack_offset
+        && k1.depth == k2.depth && k1.skip == k2.skip
+        && memcmp(k1.frames, k2.frames, sizeof(void*) * k1.frames_count) == 0;
+}
+
+bool is_stack_memo_enabled() {
+    return FLAGS_stack_memo;
+}
+
+uint32_t lookup_stack_memo(const StackMemoKey& key, bool* need_verify) {
+    const StackMemoEntry& entry = get_stack_memo_entry(key);
+    if (entry.stack_id == INVALID_STACK_ID || !is_same_key(entry.key, key)) {
+        g_stack_memo_misses.fetch_add(1, std::memory_order_relaxed);
+        return INVALID_STACK_ID;
+    }
+    g_stack_memo_hits.fetch_add(1, std::memory_order_relaxed);
+    const int interval = FLAGS_stack_memo_verify_interval;
+    *need_verify = interval > 0 && fast_rand_less_than(interval) == 0;
+    return entry.stack_id;
+}
+
+void update_stack_memo(const StackMemoKey& key, uint32_t stack_id, bool verified) {
+    StackMemoEntry& entry = get_stack_memo_entry(key);
+    if (verified) {
+        g_stack_memo_verifications.fetch_add(1, std::memory_order_relaxed);
+        if (entry.stack_id != stack_id) {
+            g_stack_memo_mismatches.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    entry.key = key;
+    entry.stack_id = stack_id;
+}
+
+void get_stack_memo_stats(int64_t* hits, int64_t* misses, int64_t* verifications, int64_t* mismatches) {
+    *hits = g_stack_memo_hits.load(std::memory_order_relaxed);
+    *misses = g_stack_memo_misses.load(std::memory_order_relaxed);
+    *verifications = g_stack_memo_verifications.load(std::memory_order_relaxed);
+    *mismatches = g_stack_memo_mismatches.load(std::memory_order_relaxed);
+}
+
+}  // namespace contention_prof
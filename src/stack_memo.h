@@ -0,0 +1,73 @@
+/**
+ * @file stack_memo.h
+ * @author noahyzhang
+ * @brief
+ * @version 0.1
+ * @date 2023-05-18
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+namespace contention_prof {
+
+// 作为 key 的最内层栈帧数量
+const int STACK_MEMO_KEY_FRAMES = 3;
+
+/**
+ * 调用栈的线程内缓存，由 stack_memo 开启
+ * 同一个锁通常只从少数几条调用链到达，相同调用链上最内层的几个返回地址相同，
+ * 栈指针到线程栈底的距离也相同。以它们为 key 缓存完整调用栈的 ID，命中时只需要一次很浅的展开
+ * key 相同而外层调用链不同时会返回错误的调用栈，命中后按 stack_memo_verify_interval 抽样做一次完整展开校验，
+ * 不一致时更新缓存并计数
+ */
+struct StackMemoKey {
+    void* frames[STACK_MEMO_KEY_FRAMES];
+    int frames_count;
+    // 栈指针到线程栈底的距离
+    uintptr_t stack_offset;
+    // 采集的参数，变化后之前缓存的调用栈都不再命中
+    int depth;
+    int skip;
+};
+
+/**
+ * @brief 是否开启了调用栈缓存，即 stack_memo
+ *
+ * @return bool
+ */
+bool is_stack_memo_enabled();
+
+/**
+ * @brief 查找缓存的调用栈
+ *
+ * @param key
+ * @param need_verify 命中并且这次需要校验时设置为 true
+ * @return uint32_t 调用栈的 ID，未命中时返回 INVALID_STACK_ID
+ */
+uint32_t lookup_stack_memo(const StackMemoKey& key, bool* need_verify);
+
+/**
+ * @brief 未命中或者校验之后更新缓存
+ *
+ * @param key
+ * @param stack_id 完整展开得到的调用栈的 ID
+ * @param verified 是否为校验，为 true 时与缓存的 ID 比较并计数
+ */
+void update_stack_memo(const StackMemoKey& key, uint32_t stack_id, bool verified);
+
+/**
+ * @brief 调用栈缓存的统计，进程内累计
+ *
+ * @param hits 命中次数（包括校验的）
+ * @param misses 未命中次数
+ * @param verifications 校验次数
+ * @param mismatches 校验发现缓存的调用栈与完整展开的不一致的次数
+ */
+void get_stack_memo_stats(int64_t* hits, int64_t* misses, int64_t* verifications, int64_t* mismatches);
+
+}  // namespace contention_prof
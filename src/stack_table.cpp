@@ -0,0 +1,197 @@
+#include <string.h>
+#include <sys/mman.h>
+#include <atomic>
+#include "common/murmurhash3.h"
+#include "stack_table.h"
+
+namespace contention_prof {
+
+// 保存的调用栈，栈帧紧跟在后面
+struct InternedStack {
+    uint32_t hash;
+    int frames_count;
+    // 调用者设置的标记，参考 set_interned_stack_mark
+    std::atomic<uint64_t> mark;
+
+    void** frames() {
+        return reinterpret_cast<void**>(this + 1);
+    }
+};
+
+// 调用栈保存在 mmap 分配的块中，块内顺序分配，块之间不连续
+const size_t STACK_ARENA_BLOCK_SIZE = 1024 * 1024;
+const size_t STACK_ARENA_MAX_BLOCKS = 1024;
+static std::atomic<char*> g_stack_arena_blocks[STACK_ARENA_MAX_BLOCKS] = {};
+static std::atomic<uint64_t> g_stack_arena_offset(0);
+
+// ID 到调用栈的索引，ID 从 1 开始，第 id - 1 项
+const size_t STACK_INDEX_BLOCK_SIZE = 16384;
+const size_t STACK_INDEX_MAX_BLOCKS = 1024;
+static std::atomic<std::atomic<InternedStack*>*> g_stack_index_blocks[STACK_INDEX_MAX_BLOCKS] = {};
+static std::atomic<uint32_t> g_stack_count(0);
+
+// 调用栈到 ID 的哈希表，结构与 g_mutex_map 相同：
+// 由多个开放寻址的表组成，第 i 个表的容量为 STACK_HASH_INIT_SIZE * 4^i，第一个表是静态的
+// 一个调用栈在每个表中最多探测 STACK_HASH_MAX_PROBES 个位置，都被占用时使用下一个表
+const size_t STACK_HASH_INIT_SIZE = 4096;
+const int STACK_HASH_MAX_TABLES = 6;
+const size_t STACK_HASH_MAX_PROBES = 16;
+static std::atomic<uint32_t> g_stack_hash_first_table[STACK_HASH_INIT_SIZE] = {};
+static std::atomic<std::atomic<uint32_t>*> g_stack_hash_tables[STACK_HASH_MAX_TABLES] = {
+    {g_stack_hash_first_table}};
+
+static std::atomic<int64_t> g_stack_table_drops(0);
+
+inline size_t get_stack_hash_capacity(int level) {
+    return STACK_HASH_INIT_SIZE << (2 * level);
+}
+
+// 获取第 index 个块，不存在时使用 mmap 分配，多个线程同时分配时只保留一个
+template <typename T>
+static T* get_or_create_block(std::atomic<T*>* blocks, size_t index, size_t bytes) {
+    T* block = blocks[index].load(std::memory_order_acquire);
+    if (block != nullptr) {
+        return block;
+    }
+    void* mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return nullptr;
+    }
+    if (!blocks[index].compare_exchange_strong(block, static_cast<T*>(mem), std::memory_order_acq_rel)) {
+        munmap(mem, bytes);
+        return block;
+    }
+    return static_cast<T*>(mem);
+}
+
+// 从块中分配 size 字节，跨越块边界时放弃这一段，从下一个块重新分配
+static void* alloc_from_arena(size_t size) {
+    while (true) {
+        const uint64_t offset = g_stack_arena_offset.fetch_add(size, std::memory_order_relaxed);
+        const size_t index = offset / STACK_ARENA_BLOCK_SIZE;
+        const size_t offset_in_block = offset % STACK_ARENA_BLOCK_SIZE;
+        if (index >= STACK_ARENA_MAX_BLOCKS) {
+            return nullptr;
+        }
+        if (offset_in_block + size > STACK_ARENA_BLOCK_SIZE) {
+            continue;
+        }
+        char* block = get_or_create_block(g_stack_arena_blocks, index, STACK_ARENA_BLOCK_SIZE);
+        if (block == nullptr) {
+            return nullptr;
+        }
+        return block + offset_in_block;
+    }
+}
+
+static InternedStack* get_stack_by_id(uint32_t stack_id) {
+    if (stack_id == INVALID_STACK_ID) {
+        return nullptr;
+    }
+    const size_t index = stack_id - 1;
+    std::atomic<InternedStack*>* block =
+        g_stack_index_blocks[index / STACK_INDEX_BLOCK_SIZE].load(std::memory_order_acquire);
+    if (block == nullptr) {
+        return nullptr;
+    }
+    return block[index % STACK_INDEX_BLOCK_SIZE].load(std::memory_order_acquire);
+}
+
+// 保存调用栈并分配 ID，此时还没有加入哈希表
+static uint32_t create_stack(void* const* frames, int frames_count, uint32_t hash) {
+    InternedStack* stack = static_cast<InternedStack*>(
+        alloc_from_arena(sizeof(InternedStack) + sizeof(void*) * frames_count));
+    if (stack == nullptr) {
+        return INVALID_STACK_ID;
+    }
+    stack->hash = hash;
+    stack->frames_count = frames_count;
+    stack->mark.store(0, std::memory_order_relaxed);
+    memcpy(stack->frames(), frames, sizeof(void*) * frames_count);
+    const uint32_t index = g_stack_count.fetch_add(1, std::memory_order_relaxed);
+    if (index >= STACK_INDEX_BLOCK_SIZE * STACK_INDEX_MAX_BLOCKS) {
+        return INVALID_STACK_ID;
+    }
+    std::atomic<InternedStack*>* block = get_or_create_block(g_stack_index_blocks,
+        index / STACK_INDEX_BLOCK_SIZE, sizeof(std::atomic<InternedStack*>) * STACK_INDEX_BLOCK_SIZE);
+    if (block == nullptr) {
+        return INVALID_STACK_ID;
+    }
+    block[index % STACK_INDEX_BLOCK_SIZE].store(stack, std::memory_order_release);
+    return index + 1;
+}
+
+static bool is_same_stack(uint32_t stack_id, void* const* frames, int frames_count, uint32_t hash) {
+    InternedStack* stack = get_stack_by_id(stack_id);
+    return stack != nullptr && stack->hash == hash && stack->frames_count == frames_count
+        && memcmp(stack->frames(), frames, sizeof(void*) * frames_count) == 0;
+}
+
+uint32_t intern_stack(void* const* frames, int frames_count) {
+    if (frames_count <= 0 || frames_count > MAX_STACK_FRAMES) {
+        return INVALID_STACK_ID;
+    }
+    uint32_t hash = 0;
+    MurmurHash3_x86_32(frames, sizeof(void*) * frames_count, frames_count, &hash);
+    // 还没有找到相同的调用栈时，在第一个空位插入，这样之后的查找在遇到空位之前一定能找到它
+    uint32_t created_id = INVALID_STACK_ID;
+    for (int level = 0; level < STACK_HASH_MAX_TABLES; ++level) {
+        std::atomic<uint32_t>* table = get_or_create_block(g_stack_hash_tables, level,
+            sizeof(std::atomic<uint32_t>) * get_stack_hash_capacity(level));
+        if (table == nullptr) {
+            break;
+        }
+        const size_t mask = get_stack_hash_capacity(level) - 1;
+        for (size_t i = 0; i < STACK_HASH_MAX_PROBES; ++i) {
+            std::atomic<uint32_t>& slot = table[(hash + i) & mask];
+            uint32_t stack_id = slot.load(std::memory_order_acquire);
+            if (stack_id == INVALID_STACK_ID) {
+                if (created_id == INVALID_STACK_ID) {
+                    created_id = create_stack(frames, frames_count, hash);
+                    if (created_id == INVALID_STACK_ID) {
+                        g_stack_table_drops.fetch_add(1, std::memory_order_relaxed);
+                        return INVALID_STACK_ID;
+                    }
+                }
+                if (slot.compare_exchange_strong(stack_id, created_id, std::memory_order_acq_rel)) {
+                    return created_id;
+                }
+                // 被其它线程抢先插入，stack_id 为它插入的 ID
+            }
+            if (is_same_stack(stack_id, frames, frames_count, hash)) {
+                return stack_id;
+            }
+        }
+    }
+    g_stack_table_drops.fetch_add(1, std::memory_order_relaxed);
+    return INVALID_STACK_ID;
+}
+
+int get_interned_stack(uint32_t stack_id, void* const** frames) {
+    InternedStack* stack = get_stack_by_id(stack_id);
+    if (stack == nullptr) {
+        return 0;
+    }
+    *frames = stack->frames();
+    return stack->frames_count;
+}
+
+uint64_t get_interned_stack_mark(uint32_t stack_id) {
+    InternedStack* stack = get_stack_by_id(stack_id);
+    return stack == nullptr ? 0 : stack->mark.load(std::memory_order_relaxed);
+}
+
+void set_interned_stack_mark(uint32_t stack_id, uint64_t mark) {
+    InternedStack* stack = get_stack_by_id(stack_id);
+    if (stack != nullptr) {
+        stack->mark.store(mark, std::memory_order_relaxed);
+    }
+}
+
+void get_stack_table_stats(size_t* stacks, size_t* bytes, int64_t* drops) {
+    *stacks = g_stack_count.load(std::memory_order_relaxed);
+    *bytes = g_stack_arena_offset.load(std::memory_order_relaxed);
+    *drops = g_stack_table_drops.load(std::memory_order_relaxed);
+}
+
+}  // namespace contention_prof
@@ -0,0 +1,74 @@
+/**
+ * @file stack_table.h
+ * @author noahyzhang
+ * @brief
+ * @version 0.1
+ * @date 2023-05-15
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "stack_trace.h"
+
+namespace contention_prof {
+
+// 无效的调用栈 ID，表示没有调用栈（采集失败或者调用栈表已满）
+const uint32_t INVALID_STACK_ID = 0;
+
+/**
+ * 调用栈表：把调用栈映射为 32 位的 ID，相同的调用栈只保存一份
+ * 采样中只保存 ID，后续的合并只需要比较整数
+ * 只增不删，整个进程共用，不随 profile 的开始和结束清空；内存由 mmap 分配，不会释放
+ * 查找和插入都是无锁的，可以在任意线程中调用；同一个调用栈被多个线程同时插入时，
+ * 只有一个 ID 会被使用，其余的保存空间被浪费
+ */
+
+/**
+ * @brief 查找调用栈的 ID，不存在时插入
+ *
+ * @param frames 调用栈
+ * @param frames_count 栈帧数量，最多 MAX_STACK_FRAMES
+ * @return uint32_t 调用栈的 ID，frames_count 为 0 或者表已满时返回 INVALID_STACK_ID
+ */
+uint32_t intern_stack(void* const* frames, int frames_count);
+
+/**
+ * @brief 获取 ID 对应的调用栈
+ *
+ * @param stack_id intern_stack 返回的 ID
+ * @param frames 输出调用栈的地址，在进程的整个生命周期内有效
+ * @return int 栈帧数量，ID 无效时返回 0
+ */
+int get_interned_stack(uint32_t stack_id, void* const** frames);
+
+/**
+ * @brief 获取调用栈的标记，每个调用栈可以附带一个 64 位的标记，初始为 0，含义由调用者决定
+ *
+ * @param stack_id intern_stack 返回的 ID
+ * @return uint64_t 标记，ID 无效时返回 0
+ */
+uint64_t get_interned_stack_mark(uint32_t stack_id);
+
+/**
+ * @brief 设置调用栈的标记
+ *
+ * @param stack_id intern_stack 返回的 ID
+ * @param mark 标记
+ */
+void set_interned_stack_mark(uint32_t stack_id, uint64_t mark);
+
+/**
+ * @brief 调用栈表的统计
+ *
+ * @param stacks 已保存的调用栈数量
+ * @param bytes 保存调用栈使用的内存
+ * @param drops 表已满而无法保存的次数
+ */
+void get_stack_table_stats(size_t* stacks, size_t* bytes, int64_t* drops);
+
+}  // namespace contention_prof
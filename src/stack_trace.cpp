@@ -0,0 +1,206 @@
+#include <execinfo.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <gflags/gflags.h>
+#include "common/log.h"
+#include "eh_frame.h"
+#include "stack_trace.h"
+
+namespace contention_prof {
+
+DEFINE_int32(stack_max_depth, 26, "Max frames kept per sampled stack, capped at 64");
+DEFINE_int32(stack_skip_frames, 0, "Extra innermost frames dropped from sampled stacks, e.g. lock wrappers");
+DEFINE_string(stack_unwinder, "auto", "How to unwind sampled stacks: auto, fp, eh_frame or backtrace");
+
+enum UnwinderType {
+    UNWINDER_UNDECIDED = 0,
+    UNWINDER_FP,
+    UNWINDER_EH_FRAME,
+    UNWINDER_BACKTRACE,
+};
+
+// 开始 profile 时由 stack_unwinder 解析出的实现，auto 为 UNWINDER_UNDECIDED
+// 采样时只读这里，不读 FLAGS_stack_unwinder，preload 在开始 profile 前会修改它
+static std::atomic<int> g_stack_unwinder(UNWINDER_UNDECIDED);
+// auto 模式下的选择结果，整个进程只决定一次
+static std::atomic<int> g_auto_unwinder(UNWINDER_UNDECIDED);
+
+// backtrace 先采集包括被跳过的栈帧在内的整个调用栈，
+// 跳过的层数为 stack_skip_frames（最多 MAX_STACK_FRAMES）加上 profiler 自身的几层
+const int MAX_BACKTRACE_FRAMES = 2 * MAX_STACK_FRAMES + 16;
+
+int get_sampled_stack_depth() {
+    const int depth = FLAGS_stack_max_depth;
+    return depth < 1 ? 1 : (depth > MAX_STACK_FRAMES ? MAX_STACK_FRAMES : depth);
+}
+
+int get_sampled_stack_skip() {
+    const int skip = FLAGS_stack_skip_frames;
+    return skip < 0 ? 0 : (skip > MAX_STACK_FRAMES ? MAX_STACK_FRAMES : skip);
+}
+
+static __thread StackBounds tls_stack_bounds = {0, 0};
+
+const StackBounds& get_current_stack_bounds() {
+    StackBounds& bounds = tls_stack_bounds;
+    if (bounds.high == 0) {
+        pthread_attr_t attr;
+        void* addr = nullptr;
+        size_t size = 0;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            pthread_attr_getstack(&attr, &addr, &size);
+            pthread_attr_destroy(&attr);
+        }
+        bounds.low = reinterpret_cast<uintptr_t>(addr);
+        bounds.high = bounds.low + size;
+        // 获取失败时置为 1，表示已经获取过，此时 low == high，任何读取都不会通过检查
+        if (bounds.high == 0) {
+            bounds.high = 1;
+            bounds.low = 1;
+        }
+    }
+    return bounds;
+}
+
+// 以下两个函数的 skip 为调用者与要采集的第一层之间还有几层，都不包括函数自己
+// 沿着帧指针遍历，x86_64 和 aarch64 上帧记录都是 [上一帧的帧指针, 返回地址]
+// 每个帧记录都必须在当前线程的栈内，并且严格向栈底方向增长，否则停止
+__attribute__((noinline)) static int fp_stack_trace(void** frames, int max_frames, int skip) {
+#if defined(__x86_64__) || defined(__aarch64__)
+    const StackBounds& bounds = get_current_stack_bounds();
+    uintptr_t fp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+    int count = 0;
+    while (count < max_frames) {
+        uintptr_t next_fp = 0;
+        uintptr_t ret = 0;
+        if (!read_stack_word(bounds, fp, &next_fp) || !read_stack_word(bounds, fp + sizeof(uintptr_t), &ret)
+            || ret == 0) {
+            break;
+        }
+        if (skip > 0) {
+            --skip;
+        } else {
+            frames[count++] = reinterpret_cast<void*>(ret);
+        }
+        if (next_fp <= fp) {
+            break;
+        }
+        fp = next_fp;
+    }
+    return count;
+#else
+    return 0;
+#endif
+}
+
+__attribute__((noinline)) static int backtrace_stack_trace(void** frames, int max_frames, int skip) {
+    void* stack[MAX_BACKTRACE_FRAMES];
+    const int n = backtrace(stack, std::min(max_frames + skip + 1, MAX_BACKTRACE_FRAMES)) - skip - 1;
+    if (n <= 0) {
+        return 0;
+    }
+    memcpy(frames, stack + skip + 1, sizeof(void*) * n);
+    return n;
+}
+
+// 与 backtrace 的结果比较，backtrace 可能比其他方式多出最外层的几帧（比如没有帧指针的 libc 启动函数），
+// 允许少这几帧
+static bool same_as_backtrace(void** frames, int count, void** bt_frames, int bt_count) {
+    const int MAX_MISSING_OUTER_FRAMES = 2;
+    return count > 0 && count <= bt_count && count + MAX_MISSING_OUTER_FRAMES >= bt_count
+        && memcmp(frames, bt_frames, sizeof(void*) * count) == 0;
+}
+
+// 依次尝试 fp、eh_frame，与 backtrace 的结果一致时使用，都不一致时使用 backtrace
+// 总是按 MAX_STACK_FRAMES 比较，只采集很浅的调用栈时，外层缺少帧指针的函数也能被发现
+// 返回最终使用的方式采集的结果，与之后的采样一致，否则同一个调用栈会因为多出的外层帧被拆成两条记录
+// 不能内联，调用栈中要固定占一层
+__attribute__((noinline)) static int decide_auto_unwinder(void** frames, int max_frames, int skip) {
+    void* fp_frames[MAX_STACK_FRAMES];
+    void* eh_frames[MAX_STACK_FRAMES];
+    void* bt_frames[MAX_STACK_FRAMES];
+    // 再跳过 decide_auto_unwinder 和 get_stack_trace 两层
+    const int fp_count = fp_stack_trace(fp_frames, MAX_STACK_FRAMES, skip + 2);
+    const int eh_count = eh_frame_stack_trace(eh_frames, MAX_STACK_FRAMES, skip + 2);
+    const int bt_count = backtrace_stack_trace(bt_frames, MAX_STACK_FRAMES, skip + 2);
+    int decided = UNWINDER_BACKTRACE;
+    const char* name = "backtrace";
+    if (same_as_backtrace(fp_frames, fp_count, bt_frames, bt_count)) {
+        decided = UNWINDER_FP;
+        name = "fp";
+    } else if (same_as_backtrace(eh_frames, eh_count, bt_frames, bt_count)) {
+        decided = UNWINDER_EH_FRAME;
+        name = "eh_frame";
+    }
+    int expected = UNWINDER_UNDECIDED;
+    if (g_auto_unwinder.compare_exchange_strong(expected, decided)) {
+        LOG(INFO) << "stack_unwinder=auto, use " << name << ", fp frames: " << fp_count
+            << ", eh_frame frames: " << eh_count << ", backtrace frames: " << bt_count;
+    } else {
+        // 其它线程已经先决定了
+        decided = expected;
+    }
+    void** decided_frames = bt_frames;
+    int count = bt_count;
+    if (decided == UNWINDER_FP) {
+        decided_frames = fp_frames;
+        count = fp_count;
+    } else if (decided == UNWINDER_EH_FRAME) {
+        // 与 get_stack_trace 相同，快照不可用时退回到 fp
+        decided_frames = eh_count < 0 ? fp_frames : eh_frames;
+        count = eh_count < 0 ? fp_count : eh_count;
+    }
+    count = std::max(0, std::min(count, max_frames));
+    memcpy(frames, decided_frames, sizeof(void*) * count);
+    prevent_tail_call(count);
+    return count;
+}
+
+void init_stack_unwinder() {
+    const std::string& unwinder = FLAGS_stack_unwinder;
+    int type = UNWINDER_UNDECIDED;
+    if (unwinder == "fp") {
+        type = UNWINDER_FP;
+    } else if (unwinder == "eh_frame") {
+        type = UNWINDER_EH_FRAME;
+    } else if (unwinder == "backtrace") {
+        type = UNWINDER_BACKTRACE;
+    } else if (unwinder != "auto") {
+        LOG(ERROR) << "unknown stack_unwinder: " << unwinder << ", use auto";
+    }
+    g_stack_unwinder.store(type, std::memory_order_relaxed);
+}
+
+int get_stack_trace(void** frames, int max_frames, int skip) {
+    int type = g_stack_unwinder.load(std::memory_order_relaxed);
+    if (type == UNWINDER_UNDECIDED) {
+        type = g_auto_unwinder.load(std::memory_order_relaxed);
+    }
+    int count = 0;
+    switch (type) {
+    case UNWINDER_FP:
+        count = fp_stack_trace(frames, max_frames, skip + 1);
+        break;
+    case UNWINDER_EH_FRAME:
+        // 快照还没有生成或者正在被 dlclose 作废时退回到 fp
+        count = eh_frame_stack_trace(frames, max_frames, skip + 1);
+        if (count < 0) {
+            count = fp_stack_trace(frames, max_frames, skip + 1);
+        }
+        break;
+    case UNWINDER_BACKTRACE:
+        count = backtrace_stack_trace(frames, max_frames, skip + 1);
+        break;
+    default:
+        count = decide_auto_unwinder(frames, max_frames, skip);
+        break;
+    }
+    prevent_tail_call(count);
+    return count;
+}
+
+}  // namespace contention_prof
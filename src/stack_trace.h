@@ -0,0 +1,87 @@
+/**
+ * @file stack_trace.h
+ * @author noahyzhang
+ * @brief
+ * @version 0.1
+ * @date 2023-05-10
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+namespace contention_prof {
+
+// 在调用之后插入一条空指令，阻止编译器把调用优化为尾调用，保证调用者在调用栈中占一层
+inline void prevent_tail_call(int& n) {
+    __asm__ __volatile__("" : "+r"(n));
+}
+
+// 采集调用栈深度的上限，stack_max_depth 不能超过它
+const int MAX_STACK_FRAMES = 64;
+
+/**
+ * @brief 采样时采集的栈帧数量，即 stack_max_depth，限制在 [1, MAX_STACK_FRAMES]
+ *
+ * @return int
+ */
+int get_sampled_stack_depth();
+
+/**
+ * @brief 采样时在 profiler 自身的栈帧之外额外跳过的栈帧数量，即 stack_skip_frames，
+ * 用于去掉调用者对锁的封装，最多 MAX_STACK_FRAMES
+ *
+ * @return int
+ */
+int get_sampled_stack_skip();
+
+// 线程栈的范围 [low, high)
+struct StackBounds {
+    uintptr_t low;
+    uintptr_t high;
+};
+
+/**
+ * @brief 获取当前线程栈的范围，每个线程只在第一次调用时获取，获取失败时 low == high
+ *
+ * @return const StackBounds&
+ */
+const StackBounds& get_current_stack_bounds();
+
+// 读取栈上的一个字，地址不在 bounds 内时返回 false
+inline bool read_stack_word(const StackBounds& bounds, uintptr_t addr, uintptr_t* value) {
+    if (addr < bounds.low || addr + sizeof(uintptr_t) > bounds.high || (addr & (sizeof(uintptr_t) - 1))) {
+        return false;
+    }
+    *value = *reinterpret_cast<const uintptr_t*>(addr);
+    return true;
+}
+
+/**
+ * @brief 解析 stack_unwinder，开始 profile 时调用，之后修改 stack_unwinder 到下一次开始 profile 时才生效
+ *
+ */
+void init_stack_unwinder();
+
+/**
+ * @brief 采集当前调用栈，结果与 glibc 的 backtrace 相同：第一个元素是调用者中的返回地址
+ * 根据 stack_unwinder 选择实现：
+ *   fp: 沿着帧指针遍历，每次读取前检查地址在当前线程的栈内，不会解析 DWARF
+ *   eh_frame: 使用缓存的各个模块的 .eh_frame_hdr 解析 DWARF CFI，不依赖帧指针，也不获取加载器的锁，
+ *         参考 eh_frame.h
+ *   backtrace: glibc 的 backtrace，依赖 _Unwind_Backtrace 和 DWARF CFI，慢并且会获取加载器的锁
+ *   auto: 默认值，第一次采集时与 backtrace 的结果比较，fp 一致（程序使用 -fno-omit-frame-pointer 编译）
+ *         则之后都使用 fp，否则 eh_frame 一致则使用 eh_frame，否则使用 backtrace
+ * 不能内联，调用栈中要固定占一层，调用者看到的层次与直接调用 backtrace 相同
+ *
+ * @param frames 输出的返回地址
+ * @param max_frames frames 的长度
+ * @param skip 跳过最内层的几帧，为 0 时第一个元素是调用者中的返回地址
+ * @return int 栈帧数量
+ */
+__attribute__((noinline)) int get_stack_trace(void** frames, int max_frames, int skip = 0);
+
+}  // namespace contention_prof